@@ -0,0 +1,113 @@
+///////////////////////////////////////////////////////////////////
+//
+//		Multithreaded Electronic PCR (me-PCR) program
+//
+//		Run-time selection of the search kernels (see
+//		kernels.h) from the features of the CPU we are
+//		running on.
+//
+///////////////////////////////////////////////////////////////////
+
+#include "kernels.h"
+
+#ifdef DMALLOC
+#include "dmalloc.h"
+#endif
+
+#if defined(EPCR_MULTI_ISA) && defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define EPCR_HAVE_CPUID 1
+#endif
+
+const char *ePCR_cpu = ePCR_CPU_DEFAULT;
+
+static const epcr_kernels_t *_kernels_available[] = {
+  &ePCR_kernels_generic,
+#ifdef EPCR_MULTI_ISA
+  &ePCR_kernels_sse42,
+  &ePCR_kernels_avx2,
+  &ePCR_kernels_avx512,
+#endif
+  NULL
+};
+
+static const epcr_kernels_t *_kernels_selected;
+
+
+// Return TRUE if this CPU (and operating system) can run kernels built
+// for the given instruction set level.
+int ePCR_CpuSupports (int isa)
+{
+#ifdef EPCR_HAVE_CPUID
+  __builtin_cpu_init();
+  switch (isa) {
+  case ePCR_ISA_GENERIC:
+    return TRUE;
+  case ePCR_ISA_SSE42:
+    return __builtin_cpu_supports("sse4.2") && __builtin_cpu_supports("popcnt");
+  case ePCR_ISA_AVX2:
+    return __builtin_cpu_supports("avx2") && __builtin_cpu_supports("bmi")
+      && __builtin_cpu_supports("bmi2") && __builtin_cpu_supports("popcnt");
+  case ePCR_ISA_AVX512:
+    return ePCR_CpuSupports(ePCR_ISA_AVX2) && __builtin_cpu_supports("avx512f")
+      && __builtin_cpu_supports("avx512bw") && __builtin_cpu_supports("avx512vl");
+  }
+  return FALSE;
+#else
+  return isa == ePCR_ISA_GENERIC;
+#endif
+}
+
+
+// Select the kernel variant by name ("auto" picks the best one this
+// CPU supports).  Returns NULL if the name is unknown or the CPU can't
+// run that variant.
+const epcr_kernels_t *ePCR_SelectKernels (const char *name)
+{
+  const epcr_kernels_t *best = NULL;
+  int i;
+
+  for (i=0; _kernels_available[i]; i++) {
+    const epcr_kernels_t *k = _kernels_available[i];
+    if (name == NULL || strcasecmp(name, "auto") == 0) {
+      if (ePCR_CpuSupports(k->isa) && (best == NULL || k->isa > best->isa))
+	best = k;
+    } else if (strcasecmp(name, k->name) == 0) {
+      if (!ePCR_CpuSupports(k->isa)) {
+	fprintf (stderr, "Error: this CPU cannot run the '%s' kernels\n", k->name);
+	return NULL;
+      }
+      best = k;
+    }
+  }
+
+  if (best == NULL) {
+    fprintf (stderr, "Error: unknown kernel variant '%s' (C=): ", name ? name : "auto");
+    ePCR_ListKernels(stderr);
+    return NULL;
+  }
+
+  _kernels_selected = best;
+  return best;
+}
+
+
+const epcr_kernels_t *ePCR_GetKernels (void)
+{
+  if (_kernels_selected == NULL)
+    ePCR_SelectKernels(NULL);
+  return _kernels_selected;
+}
+
+
+// Print the kernel variants built into this program, marking the
+// ones this CPU can't run.
+void ePCR_ListKernels (FILE *f)
+{
+  int i;
+
+  fprintf (f, "auto");
+  for (i=0; _kernels_available[i]; i++)
+    fprintf (f, ", %s%s", _kernels_available[i]->name,
+	     ePCR_CpuSupports(_kernels_available[i]->isa) ? "" : " (unsupported)");
+  fprintf (f, "\n");
+}
@@ -18,9 +18,12 @@
 // 2002-11-22 KPM: Fixed destructors so all allocations are deallocated
 // 2002-12-16 KPM: Terminated the parsed fasta buffer
 
+#define _REENTRANT
+#include <pthread.h>
 #include <math.h>
 #include <time.h>
 #include "fasta-io.h"
+#include "kernels.h"
 
 #ifdef DMALLOC
 #include "dmalloc.h"
@@ -320,6 +323,18 @@ void FastaFile::Read (void)
 }
 
 
+// Build the map for filtering and upcasing the sequence data.
+static void BuildCharmap (unsigned char *charmap, const char *alphabet)
+{
+  memset (charmap, 0, 256);
+  unsigned char c;
+  while ((c=*alphabet++)) {
+    charmap[toupper(c)] = toupper(c);
+    charmap[tolower(c)] = toupper(c);
+  }
+}
+
+
 // Organize the sequences in the fasta file into a vector of FastaSeq
 // objects (which involves stripping the control characters from the
 // data, among other things).
@@ -341,13 +356,7 @@ void FastaFile::ParseText (char *text, const char *alphabet)
     return;
 
 	
-  // Build the map for filtering and upcasing the sequence data.
-  memset (charmap, 0, sizeof(charmap));
-  unsigned char c;
-  while ((c=*alphabet++)) {
-    charmap[toupper(c)] = toupper(c);
-    charmap[tolower(c)] = toupper(c);
-  }
+  BuildCharmap (charmap, alphabet);
 
 #ifdef N_MODE
   // Build the map for testing ambiguity (post filter map)
@@ -404,10 +413,13 @@ void FastaFile::ParseText (char *text, const char *alphabet)
 	// '>', signalling another sequence ('>' is not a valid
 	// character in a FASTA file, outside of the description
 	// line.)
+#ifndef N_MODE
+	p1 = ePCR_GetKernels()->parse(p1, &p2, charmap);
+	chr = *p2;
+#else
 	while ((chr = *p2) != '\0' && chr != '>') {
 	  p2++;
 	  if ((chr=charmap[chr])) {
-#ifdef N_MODE
 	    if (in_n_block) {
 	      if (is_acgt[chr]) {
 		in_n_block = 0;
@@ -419,10 +431,10 @@ void FastaFile::ParseText (char *text, const char *alphabet)
 	      }
 	    }
 	      
-#endif
 	    *p1++ = chr;
 	  }
 	}  // end while
+#endif
 	
 	// NOTA BENE: p2 is now pointing to either a '\0' or a '>'
 
@@ -474,3 +486,240 @@ void FastaFile::ParseText ( char *text, int seqtype)
   return;
 } // end ParseText
 
+
+
+///////////////////////////////////////////////////////////////
+//
+//		Reading and parsing in a pipeline
+//
+
+// The blocks read ahead by ReadBlocks() for FastaFile::ReadWindows():
+// block number i is in block[i % ePCR_READ_BLOCKS], len[] bytes of it
+// followed by a '\0'.  A block shorter than ePCR_READ_BLOCK is the last.
+typedef struct {
+  FILE *file;
+  pthread_mutex_t lock;
+  pthread_cond_t filled;        // signalled when a block has been read
+  pthread_cond_t emptied;       // signalled when a block has been parsed
+  char *block[ePCR_READ_BLOCKS];
+  size_t len[ePCR_READ_BLOCKS];
+  unsigned long num_read;       // protected by lock
+  unsigned long num_parsed;     // protected by lock
+  int error;
+} fasta_reader_t;
+
+
+static void *ReadBlocks (void *arg)
+{
+  fasta_reader_t *r = (fasta_reader_t *) arg;
+  size_t n;
+
+  do {
+    pthread_mutex_lock (&r->lock);
+    while (r->num_read - r->num_parsed == ePCR_READ_BLOCKS)
+      pthread_cond_wait (&r->emptied, &r->lock);
+    int i = r->num_read % ePCR_READ_BLOCKS;
+    pthread_mutex_unlock (&r->lock);
+
+    n = fread (r->block[i], 1, ePCR_READ_BLOCK, r->file);
+    r->block[i][n] = '\0';
+
+    pthread_mutex_lock (&r->lock);
+    r->len[i] = n;
+    if (n < ePCR_READ_BLOCK)
+      r->error = ferror (r->file);
+    r->num_read++;
+    pthread_cond_signal (&r->filled);
+    pthread_mutex_unlock (&r->lock);
+  } while (n == ePCR_READ_BLOCK);
+
+  return NULL;
+}
+
+
+// Read and parse the file as Read() does, but a block at a time, with
+// the reading done by a thread of its own, and pass each sequence to
+// fn as it is parsed (see fasta_window_fn_t), so that it can be
+// searched while the rest of the file is read.  The sequences are
+// kept (see Seqs()) and stay where fn was shown them.
+void FastaFile::ReadWindows (fasta_window_fn_t fn, void *ctx)
+{
+  time_t start_time = 0;  // 0 just to avoid warning
+  unsigned char charmap[256];
+  fasta_reader_t reader;
+  pthread_t thread;
+  size_t FileSize;
+  int i, rv;
+
+  if (m_seqtype == SEQTYPE_AA)
+    BuildCharmap (charmap, chrValidAa);
+  else if (m_seqtype == SEQTYPE_NT)
+    BuildCharmap (charmap, chrValidNt);
+  else {
+    PrintError("FastaFile::ReadWindows();   ERROR: Invalid code");
+    exit(1);
+  }
+
+  FileSize = ePCR_FileSize(m_name);
+
+  if (!ePCR_quiet) {
+    start_time = time(NULL);
+    if (!FileSize) {
+      fprintf (stderr, "Sequence file [%s] is empty!\n", m_name);
+      return;
+    }
+    fprintf (stderr, "Reading and parsing the sequence file ...\n");
+  }
+
+  if (!IsOpen())
+    return;
+
+  // The parsed sequences, each followed by a '\0', take no more room
+  // than the file; the parse kernel may store up to 16 bytes ahead.
+  if (!MemAlloc(m_seq_base, FileSize+17)) {
+    fprintf (stderr, "Out of memory in FastaFile::ReadWindows\n");
+    exit(1);
+  }
+
+  reader.file = m_file;
+  reader.num_read = 0;
+  reader.num_parsed = 0;
+  reader.error = 0;
+  for (i=0; i<ePCR_READ_BLOCKS; i++) {
+    if (!MemAlloc(reader.block[i], ePCR_READ_BLOCK+16)) {
+      fprintf (stderr, "Out of memory in FastaFile::ReadWindows\n");
+      exit(1);
+    }
+  }
+  pthread_mutex_init (&reader.lock, NULL);
+  pthread_cond_init (&reader.filled, NULL);
+  pthread_cond_init (&reader.emptied, NULL);
+  rv = pthread_create (&thread, NULL, ReadBlocks, &reader);
+  if (rv != 0) {
+    fprintf (stderr, "error starting the thread to read the sequence file. Code=%d\n", rv);
+    exit(1);
+  }
+
+  // The parse goes from one state to the next as it meets the '>' of a
+  // defline and then the end of that line; a defline is collected in
+  // defline, as it may run across blocks.
+  enum { START, DEFLINE, BASES } state = START;
+  char *dst = m_seq_base, *seq_start = dst;
+  char *defline = NULL;
+  size_t def_len = 0, def_allocated = 0;
+  char prev = '\n';        // the character before the block
+  FastaSeq *seq = NULL;
+  size_t n;
+
+  do {
+    pthread_mutex_lock (&reader.lock);
+    while (reader.num_read == reader.num_parsed)
+      pthread_cond_wait (&reader.filled, &reader.lock);
+    i = reader.num_parsed % ePCR_READ_BLOCKS;
+    n = reader.len[i];
+    pthread_mutex_unlock (&reader.lock);
+
+    const char *block = reader.block[i], *p = block, *end = block + n;
+
+    while (p < end) {
+      if (state == DEFLINE) {
+	size_t line = strcspn (p, "\r\n");
+	if (def_len + line + 1 > def_allocated) {
+	  def_allocated = def_len + line + 1 + 256;
+	  if (!MemResize(defline, def_allocated)) {
+	    fprintf (stderr, "Out of memory in FastaFile::ReadWindows\n");
+	    exit(1);
+	  }
+	}
+	memcpy (defline + def_len, p, line);
+	def_len += line;
+	p += line;
+	if (p < end) {
+	  defline[def_len] = '\0';
+	  seq->SetDefline (defline);
+	  seq_start = dst;
+	  state = BASES;
+	}
+	continue;
+      }
+
+      if (*p == '>') {
+	if (state == BASES) {
+	  char before = (p > block) ? p[-1] : prev;
+	  if (before != '\n' && before != '\r') {
+	    fprintf (stderr, "Error: unexpected '>' encountered not at the beginning of a line.\n");
+	    exit(1);
+	  }
+	  seq->SetSequence (seq_start);
+	  seq->SetLength (dst - seq_start);
+	  *dst++ = '\0';
+	  fn (ctx, seq->Label(), seq_start, seq->Length(), TRUE);
+	}
+
+	if (m_numseqs == m_maxseqs) {
+	  // expand storage for sequences
+	  m_maxseqs += 100;
+	  if (!MemResize(m_seqs, m_maxseqs * sizeof(FastaSeq *))) {
+	    fprintf(stderr, "Out of memory trying to allocate room for %u sequences\n", m_maxseqs);
+	    exit(1);
+	  }
+	}
+	seq = m_seqs[m_numseqs++] = new FastaSeq;
+	def_len = 0;
+	p++;
+	state = DEFLINE;
+      }
+      else if (state == START) {
+	fprintf (stderr, "Error: expected '>'.  This version of e-PCR does not support more than one sequence in a file\n");
+	exit (1);
+      }
+      else {
+	// Stops at a '>' or at the '\0' ending the block (or one in it)
+	dst = ePCR_GetKernels()->parse(dst, &p, charmap);
+	if (p < end && *p == '\0')
+	  p++;
+      }
+    }
+    if (n > 0)
+      prev = end[-1];
+
+    if (state == BASES)
+      fn (ctx, seq->Label(), seq_start, dst - seq_start, FALSE);
+
+    pthread_mutex_lock (&reader.lock);
+    reader.num_parsed++;
+    pthread_cond_signal (&reader.emptied);
+    pthread_mutex_unlock (&reader.lock);
+  } while (n == ePCR_READ_BLOCK);
+
+  pthread_join (thread, NULL);
+  if (reader.error) {
+    fprintf (stderr, "Error reading fasta file in FastaFile::ReadWindows\n");
+    exit(1);
+  }
+
+  // The last sequence ends with the file
+  if (state == DEFLINE) {
+    defline[def_len] = '\0';
+    seq->SetDefline (defline);
+    seq_start = dst;
+  }
+  if (state != START) {
+    seq->SetSequence (seq_start);
+    seq->SetLength (dst - seq_start);
+    *dst = '\0';
+    fn (ctx, seq->Label(), seq_start, seq->Length(), TRUE);
+  }
+
+  MemDealloc (defline);
+  for (i=0; i<ePCR_READ_BLOCKS; i++)
+    MemDealloc (reader.block[i]);
+  pthread_cond_destroy (&reader.emptied);
+  pthread_cond_destroy (&reader.filled);
+  pthread_mutex_destroy (&reader.lock);
+
+  if (!ePCR_quiet) {
+    fprintf (stderr, "\t%3d %% done\n", 100);
+    fprintf (stderr, "Elapsed time reading and parsing the sequence file: %lu seconds\n\n", (unsigned long) (time(NULL) - start_time));
+  }
+}
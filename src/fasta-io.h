@@ -13,6 +13,18 @@ extern char chrValidNt[];
 #define SEQTYPE_AA 1
 #define SEQTYPE_NT 2
 
+// FastaFile::ReadWindows() reads the file in blocks of this size, in
+// a thread of its own, while the blocks before are parsed
+#ifndef ePCR_READ_BLOCK
+#define ePCR_READ_BLOCK (1 << 20)
+#endif
+#define ePCR_READ_BLOCKS 4
+
+// Called by FastaFile::ReadWindows() after each block: with the bases
+// of the sequence being parsed so far (len of them, at data), and with
+// complete TRUE once all of a sequence has been parsed.
+typedef void (*fasta_window_fn_t) (void *ctx, const char *label, const char *data, size_t len, int complete);
+
 
 class FastaSeq
 {
@@ -67,6 +79,7 @@ public:
 	void ParseText (char *text, const char *alphabet);
 
 	void Read (void);
+	void ReadWindows (fasta_window_fn_t fn, void *ctx);
 	bool Write (FastaSeq &seq);
 
 	unsigned NumSeqs(void);
@@ -0,0 +1,541 @@
+///////////////////////////////////////////////////////////////////
+//
+//		Multithreaded Electronic PCR (me-PCR) program
+//
+//		FM-index of a sequence file for the fm engine (see
+//		fmindex.h): construction, saving and loading, and the
+//		backward search for left primers.
+//
+///////////////////////////////////////////////////////////////////
+
+#include <errno.h>
+#include <limits.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#if !defined(EPCR_NO_MMAP) && (defined(__MWERKS__) || defined(_WIN32))
+#define EPCR_NO_MMAP
+#endif
+
+#ifndef EPCR_NO_MMAP
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+#include "fmindex.h"
+#include "fasta-io.h"
+#include "kernels.h"
+
+#ifdef DMALLOC
+#include "dmalloc.h"
+#endif
+
+static const char fm_magic[8] = "ePCRfm1";
+
+#define FM_BYTE_ORDER 0x01020304
+#define FM_TEXT_PADDING 64
+#define FM_ALIGN(x) (((x) + 7) & ~(size_t)7)
+
+
+// Set the section pointers of fm for a block at base (which may be
+// NULL, to find the size) from n, num_seqs and labels_size; return the
+// size of the block.
+static size_t fm_layout (epcr_fm_index_t *fm, char *base)
+{
+  size_t blocks = fm->n / ePCR_FM_OCC_RATE + 1;
+  size_t size = 0;
+
+#define FM_SECTION(field,type,count) \
+  fm->field = base ? (type *) (base + size) : NULL; \
+  size += FM_ALIGN((size_t)(count) * sizeof(type));
+
+  FM_SECTION(seq_start, unsigned, fm->num_seqs);
+  FM_SECTION(seq_len, unsigned, fm->num_seqs);
+  FM_SECTION(label_offset, unsigned, fm->num_seqs);
+  FM_SECTION(C, unsigned, ePCR_FM_SYMBOLS+1);
+  FM_SECTION(labels, char, fm->labels_size);
+  FM_SECTION(text, char, (size_t)fm->n + FM_TEXT_PADDING);
+  FM_SECTION(bwt, unsigned char, fm->n);
+  FM_SECTION(occ, unsigned, blocks * (ePCR_FM_SYMBOLS-1));
+  FM_SECTION(sampled, unsigned long long, blocks);
+  FM_SECTION(sample_rank, unsigned, blocks);
+  FM_SECTION(samples, unsigned, (fm->n - 1) / ePCR_FM_SA_RATE + 1);
+#undef FM_SECTION
+
+  return size;
+}
+
+
+// Modification time of the sequence file, to nanoseconds where the
+// system keeps them (so that an index can't go stale within a second)
+static unsigned long long fm_mtime (const struct stat &st)
+{
+#ifdef __linux__
+  return (unsigned long long) st.st_mtime * 1000000000ULL + st.st_mtim.tv_nsec;
+#else
+  return st.st_mtime;
+#endif
+}
+
+
+static inline int fm_symbol (char c)
+{
+  int j = _scode[(unsigned char)c];
+  return j == AMBIG ? ePCR_FM_SYMBOLS-1 : j+1;
+}
+
+
+// Suffix array construction by induced sorting (SA-IS: Nong, Zhang
+// and Chan, "Two efficient algorithms for linear time suffix array
+// construction", 2011), in linear time whatever the repeats.  s is an
+// array of n bytes (cs = 1) or ints (cs = sizeof(int)) over [0, K);
+// s[n-1] must be the only 0.
+
+#define SAIS_CHR(i) (cs == sizeof(int) ? ((const int *)s)[i] : ((const unsigned char *)s)[i])
+#define SAIS_TGET(i) ((t[(i)/8] >> ((i)%8)) & 1)
+#define SAIS_TSET(i,b) t[(i)/8] = (b) ? (t[(i)/8] | (1 << ((i)%8))) : (t[(i)/8] & ~(1 << ((i)%8)))
+#define SAIS_ISLMS(i) ((i) > 0 && SAIS_TGET(i) && !SAIS_TGET((i)-1))
+
+static void sais_buckets (const void *s, int n, int K, int cs, int *bkt, int end)
+{
+  int i, sum = 0;
+
+  memset (bkt, 0, (K+1)*sizeof(int));
+  for (i=0; i<n; i++)
+    bkt[SAIS_CHR(i)]++;
+  for (i=0; i<=K; i++) {
+    sum += bkt[i];
+    bkt[i] = end ? sum : sum - bkt[i];
+  }
+}
+
+static void sais_induce (const unsigned char *t, int *SA, const void *s, int n, int K, int cs, int *bkt)
+{
+  int i, j;
+
+  sais_buckets(s, n, K, cs, bkt, 0);  // L-type suffixes, left to right
+  for (i=0; i<n; i++)
+    if ((j = SA[i]-1) >= 0 && !SAIS_TGET(j))
+      SA[bkt[SAIS_CHR(j)]++] = j;
+  sais_buckets(s, n, K, cs, bkt, 1);  // S-type suffixes, right to left
+  for (i=n-1; i>=0; i--)
+    if ((j = SA[i]-1) >= 0 && SAIS_TGET(j))
+      SA[--bkt[SAIS_CHR(j)]] = j;
+}
+
+static void sais (const void *s, int *SA, int n, int K, int cs)
+{
+  unsigned char *t;
+  int *bkt;
+  int i, j, n1, name, prev;
+
+  if (!MemAlloc(t, n/8+1) || !MemAlloc(bkt, (K+1)*sizeof(int))) {
+    fprintf (stderr, "Out of memory building the FM index\n");
+    exit(1);
+  }
+
+  // Classify the suffixes as S-type (1) or L-type (0)
+  SAIS_TSET(n-1, 1);
+  if (n > 1)
+    SAIS_TSET(n-2, 0);
+  for (i=n-3; i>=0; i--)
+    SAIS_TSET(i, SAIS_CHR(i) < SAIS_CHR(i+1) || (SAIS_CHR(i) == SAIS_CHR(i+1) && SAIS_TGET(i+1)));
+
+  // Sort the LMS substrings
+  sais_buckets(s, n, K, cs, bkt, 1);
+  for (i=0; i<n; i++)
+    SA[i] = -1;
+  for (i=1; i<n; i++)
+    if (SAIS_ISLMS(i))
+      SA[--bkt[SAIS_CHR(i)]] = i;
+  sais_induce(t, SA, s, n, K, cs, bkt);
+
+  // Name them, keeping the names in text order after the sorted ones
+  for (i=0, n1=0; i<n; i++)
+    if (SAIS_ISLMS(SA[i]))
+      SA[n1++] = SA[i];
+  for (i=n1; i<n; i++)
+    SA[i] = -1;
+  for (i=0, name=0, prev=-1; i<n1; i++) {
+    int pos = SA[i], diff = 0, d;
+    for (d=0; d<n; d++)
+      if (prev == -1 || SAIS_CHR(pos+d) != SAIS_CHR(prev+d) || SAIS_TGET(pos+d) != SAIS_TGET(prev+d)) {
+	diff = 1;
+	break;
+      } else if (d > 0 && (SAIS_ISLMS(pos+d) || SAIS_ISLMS(prev+d)))
+	break;
+    if (diff) {
+      name++;
+      prev = pos;
+    }
+    SA[n1 + pos/2] = name - 1;
+  }
+  for (i=n-1, j=n-1; i>=n1; i--)
+    if (SA[i] >= 0)
+      SA[j--] = SA[i];
+
+  // Sort the reduced string, recursively if the names aren't unique
+  int *s1 = SA + n - n1;
+  if (name < n1)
+    sais(s1, SA, n1, name, sizeof(int));
+  else
+    for (i=0; i<n1; i++)
+      SA[s1[i]] = i;
+
+  // Induce the order of all the suffixes from that of the LMS ones
+  sais_buckets(s, n, K, cs, bkt, 1);
+  for (i=1, j=0; i<n; i++)
+    if (SAIS_ISLMS(i))
+      s1[j++] = i;
+  for (i=0; i<n1; i++)
+    SA[i] = s1[SA[i]];
+  for (i=n1; i<n; i++)
+    SA[i] = -1;
+  for (i=n1-1; i>=0; i--) {
+    j = SA[i];
+    SA[i] = -1;
+    SA[--bkt[SAIS_CHR(j)]] = j;
+  }
+  sais_induce(t, SA, s, n, K, cs, bkt);
+
+  MemDealloc(t);
+  MemDealloc(bkt);
+}
+
+#undef SAIS_CHR
+#undef SAIS_TGET
+#undef SAIS_TSET
+#undef SAIS_ISLMS
+
+static unsigned *fm_suffix_array (const unsigned char *s, unsigned n)
+{
+  int *sa;
+
+  if (!MemAlloc(sa, (size_t)n*sizeof(int))) {
+    fprintf (stderr, "Out of memory building the FM index\n");
+    exit(1);
+  }
+  sais(s, sa, (int)n, ePCR_FM_SYMBOLS, 1);
+  return (unsigned *) sa;
+}
+
+
+static epcr_fm_index_t *fm_build (const char *seqfile)
+{
+  FastaFile fafile(SEQTYPE_NT);
+  epcr_fm_index_t *fm;
+  unsigned long long n = 1, labels_size = 0;
+  unsigned char *sym;
+  unsigned *sa, i, r, c;
+  unsigned counts[ePCR_FM_SYMBOLS];
+  time_t start_time = time(NULL);
+
+  if (!fafile.Open(seqfile,"rb"))
+    exit(1);
+  fafile.Read();
+
+  FastaSeq **seqs = fafile.Seqs();
+  for (i=0; i<fafile.NumSeqs(); i++) {
+    n += (unsigned long long) seqs[i]->Length() + 1;
+    labels_size += strlen(seqs[i]->Label()) + 1;
+  }
+  if (n >= INT_MAX - FM_TEXT_PADDING || labels_size >= UINT_MAX) {
+    fprintf (stderr, "Error: '%s' is too large for the fm engine\n", seqfile);
+    exit(1);
+  }
+
+  fm = new epcr_fm_index_t;
+  fm->n = (unsigned) n;
+  fm->num_seqs = fafile.NumSeqs();
+  fm->labels_size = (unsigned) labels_size;
+  fm->block_size = fm_layout(fm, NULL);
+  fm->mapped = 0;
+  if (!MemAlloc(fm->block, fm->block_size) || !MemAlloc(sym, n)) {
+    fprintf (stderr, "Out of memory building the FM index\n");
+    exit(1);
+  }
+  memset (fm->block, 0, fm->block_size);
+  fm_layout(fm, (char *)fm->block);
+
+  // The text and the sequence table
+  unsigned pos = 0, label_pos = 0;
+  for (i=0; i<fm->num_seqs; i++) {
+    fm->seq_start[i] = pos;
+    fm->seq_len[i] = seqs[i]->Length();
+    fm->label_offset[i] = label_pos;
+    strcpy (fm->labels + label_pos, seqs[i]->Label());
+    label_pos += strlen(seqs[i]->Label()) + 1;
+    memcpy (fm->text + pos, seqs[i]->Sequence(), fm->seq_len[i]);
+    pos += fm->seq_len[i] + 1;
+  }
+  fafile.Close();
+
+  memset (counts, 0, sizeof(counts));
+  for (i=0; i<fm->n-1; i++)
+    counts[sym[i] = fm_symbol(fm->text[i])]++;
+  sym[fm->n-1] = 0;
+  counts[0]++;
+  fm->C[0] = 0;
+  for (c=0; c<ePCR_FM_SYMBOLS; c++)
+    fm->C[c+1] = fm->C[c] + counts[c];
+
+  if (!ePCR_quiet)
+    fprintf (stderr, "Sorting %u suffixes ...\n", fm->n);
+  sa = fm_suffix_array(sym, fm->n);
+
+  // BWT, occurrence counts and suffix array samples
+  unsigned samples = 0;
+  memset (counts, 0, sizeof(counts));
+  for (r=0; r<=fm->n; r++) {
+    if (r % ePCR_FM_OCC_RATE == 0) {
+      for (c=1; c<ePCR_FM_SYMBOLS; c++)
+	fm->occ[(r/ePCR_FM_OCC_RATE)*(ePCR_FM_SYMBOLS-1) + c-1] = counts[c];
+      fm->sample_rank[r/64] = samples;
+    }
+    if (r == fm->n)
+      break;
+    fm->bwt[r] = sa[r] ? sym[sa[r]-1] : 0;
+    counts[fm->bwt[r]]++;
+    if (sa[r] % ePCR_FM_SA_RATE == 0) {
+      fm->sampled[r/64] |= 1ULL << (r%64);
+      fm->samples[samples++] = sa[r];
+    }
+  }
+
+  MemDealloc(sa);
+  MemDealloc(sym);
+
+  if (!ePCR_quiet)
+    fprintf (stderr, "Elapsed time building the FM index: %d seconds\n", (int)(time(NULL)-start_time));
+  return fm;
+}
+
+
+static void fm_save (const epcr_fm_index_t *fm, const char *indexfile, const struct stat &source)
+{
+  epcr_fm_header_t header;
+  FILE *f;
+
+  memset (&header, 0, sizeof(header));
+  memcpy (header.magic, fm_magic, sizeof(header.magic));
+  header.source_size = source.st_size;
+  header.source_mtime = fm_mtime(source);
+  header.size = fm->block_size;
+  header.byte_order = FM_BYTE_ORDER;
+  header.n = fm->n;
+  header.num_seqs = fm->num_seqs;
+  header.labels_size = fm->labels_size;
+
+  if ((f = fopen(indexfile, "wb")) == NULL) {
+    fprintf (stderr, "Warning: can't write the FM index '%s': errno=%d\n", indexfile, errno);
+    return;
+  }
+  int ok = fwrite(&header, sizeof(header), 1, f) == 1
+    && fwrite(fm->block, fm->block_size, 1, f) == 1;
+  if (fclose(f) != 0 || !ok) {
+    fprintf (stderr, "Warning: can't write the FM index '%s': errno=%d\n", indexfile, errno);
+    remove (indexfile);
+  }
+  else if (!ePCR_quiet)
+    fprintf (stderr, "Saved the FM index as '%s'\n", indexfile);
+}
+
+
+// Load the index saved for the sequence file described by source, or
+// return NULL if there is none or it is out of date.
+static epcr_fm_index_t *fm_load (const char *indexfile, const struct stat &source)
+{
+  epcr_fm_header_t header;
+  epcr_fm_index_t *fm;
+  FILE *f;
+
+  if ((f = fopen(indexfile, "rb")) == NULL)
+    return NULL;
+  if (fread(&header, sizeof(header), 1, f) != 1
+      || memcmp(header.magic, fm_magic, sizeof(header.magic)) != 0
+      || header.byte_order != FM_BYTE_ORDER
+      || header.source_size != (unsigned long long) source.st_size
+      || header.source_mtime != fm_mtime(source)) {
+    fclose (f);
+    if (!ePCR_quiet)
+      fprintf (stderr, "The FM index '%s' is out of date\n", indexfile);
+    return NULL;
+  }
+
+  fm = new epcr_fm_index_t;
+  fm->n = header.n;
+  fm->num_seqs = header.num_seqs;
+  fm->labels_size = header.labels_size;
+  fm->block_size = fm_layout(fm, NULL);
+  if (fm->block_size != header.size) {
+    fprintf (stderr, "Error: the FM index '%s' is corrupt\n", indexfile);
+    exit(1);
+  }
+
+#ifndef EPCR_NO_MMAP
+  // Map the file; only the pages a search touches get read
+  void *map = mmap(NULL, sizeof(header) + fm->block_size, PROT_READ, MAP_PRIVATE, fileno(f), 0);
+  if (map != MAP_FAILED) {
+    fm->block = (char *)map + sizeof(header);
+    fm->mapped = 1;
+  } else
+#endif
+  {
+    fm->mapped = 0;
+    if (!MemAlloc(fm->block, fm->block_size)) {
+      fprintf (stderr, "Out of memory loading the FM index\n");
+      exit(1);
+    }
+    if (fread(fm->block, fm->block_size, 1, f) != 1) {
+      fprintf (stderr, "Error: reading the FM index '%s': errno=%d\n", indexfile, errno);
+      exit(1);
+    }
+  }
+  fclose (f);
+  fm_layout(fm, (char *)fm->block);
+
+  if (!ePCR_quiet)
+    fprintf (stderr, "Using the FM index '%s' (%u sequences)\n", indexfile, fm->num_seqs);
+  return fm;
+}
+
+
+// Open the FM index of seqfile: load indexfile, or build the index and
+// save it there if it is missing or older than seqfile.
+epcr_fm_index_t *ePCR_FmOpen (const char *seqfile, const char *indexfile)
+{
+  struct stat source;
+  epcr_fm_index_t *fm;
+
+  if (stat(seqfile, &source) != 0) {
+    fprintf (stderr, "Error: opening '%s': errno=%d\n", seqfile, errno);
+    exit(1);
+  }
+  if ((fm = fm_load(indexfile, source)) != NULL)
+    return fm;
+
+  if (!ePCR_quiet)
+    fprintf (stderr, "Building the FM index of '%s' ...\n", seqfile);
+  fm = fm_build(seqfile);
+  fm_save(fm, indexfile, source);
+  return fm;
+}
+
+
+void ePCR_FmClose (epcr_fm_index_t *fm)
+{
+  if (!fm)
+    return;
+#ifndef EPCR_NO_MMAP
+  if (fm->mapped)
+    munmap ((char *)fm->block - sizeof(epcr_fm_header_t), fm->block_size + sizeof(epcr_fm_header_t));
+  else
+#endif
+    MemDealloc(fm->block);
+  delete fm;
+}
+
+
+// Number of times symbol c occurs in bwt[0, r)
+static inline unsigned fm_occ (const epcr_fm_index_t *fm, int c, unsigned r)
+{
+  unsigned b = r / ePCR_FM_OCC_RATE;
+  unsigned count = fm->occ[b*(ePCR_FM_SYMBOLS-1) + c-1];
+  const unsigned char *p = fm->bwt + b*ePCR_FM_OCC_RATE, *end = fm->bwt + r;
+
+  while (p < end)
+    count += (*p++ == c);
+  return count;
+}
+
+static inline int fm_popcount (unsigned long long x)
+{
+#ifdef __GNUC__
+  return __builtin_popcountll(x);
+#else
+  int n = 0;
+  for (; x; x &= x-1)
+    n++;
+  return n;
+#endif
+}
+
+// Text position of the suffix in row r, found by stepping back to the
+// nearest sampled position (at most ePCR_FM_SA_RATE-1 steps)
+static unsigned fm_locate (const epcr_fm_index_t *fm, unsigned r)
+{
+  unsigned steps = 0;
+
+  while (!((fm->sampled[r/64] >> (r%64)) & 1)) {
+    int c = fm->bwt[r];
+    r = fm->C[c] + fm_occ(fm, c, r);
+    steps++;
+  }
+  return fm->samples[fm->sample_rank[r/64] + fm_popcount(fm->sampled[r/64] & ((1ULL << (r%64)) - 1))] + steps;
+}
+
+
+typedef struct {
+  const epcr_fm_index_t *fm;
+  const STS *sts;
+  epcr_fm_hits_t *hits;
+} fm_search_t;
+
+// Extend the rows [lo, hi), which match p1[i+1, ...), by p1[i] and
+// the bases before it, allowing mmatch more mismatches.  Each base of
+// the sequence that isn't A, C, G or T, and each primer base that
+// isn't either, is taken as a match here: whether it is one depends on
+// the I= mode, and Match() decides.  No mismatch is tried where X=
+// doesn't allow one.
+static void fm_backtrack (fm_search_t &s, int i, unsigned lo, unsigned hi, int mmatch)
+{
+  if (lo >= hi)
+    return;
+  if (i < 0) {
+    epcr_fm_hits_t *h = s.hits;
+    for (; lo < hi; lo++) {
+      if (h->num == h->allocated) {
+	h->allocated = h->allocated ? 2*h->allocated : 256;
+	if (!MemResize(h->pos, h->allocated*sizeof(unsigned))) {
+	  fprintf (stderr, "Out of memory in the fm engine\n");
+	  exit(1);
+	}
+      }
+      h->pos[h->num++] = fm_locate(s.fm, lo);
+    }
+    return;
+  }
+
+  int base = fm_symbol(s.sts->pcr_p1[i]);
+  int strict = i < 64 && ((s.sts->p1_3prime_mask >> i) & 1);
+
+  for (int c=1; c<ePCR_FM_SYMBOLS; c++) {
+    int cost = (c == base || c == ePCR_FM_SYMBOLS-1 || base == ePCR_FM_SYMBOLS-1) ? 0 : 1;
+    if (cost > mmatch || (cost && strict))
+      continue;
+    fm_backtrack(s, i-1, s.fm->C[c] + fm_occ(s.fm, c, lo), s.fm->C[c] + fm_occ(s.fm, c, hi), mmatch-cost);
+  }
+}
+
+
+// The hash engine only tries an STS where the word of its left primer
+// at hash_offset occurs exactly, and then allows up to N mismatches in
+// the rest of the primer.  The backward search does the same: it finds
+// the word, then extends it to the left with up to N mismatches.  Bases
+// of the primer after the word (if it has any) are left to Match().
+void ePCR_FmFindLeft (const epcr_fm_index_t *fm, const STS *sts, unsigned wsize, int mmatch,
+		      epcr_fm_hits_t &hits)
+{
+  fm_search_t s = { fm, sts, &hits };
+  unsigned lo = 0, hi = fm->n;
+  int i;
+
+  for (i = sts->hash_offset + wsize - 1; i >= (int) sts->hash_offset && lo < hi; i--) {
+    int c = fm_symbol(sts->pcr_p1[i]);
+    lo = fm->C[c] + fm_occ(fm, c, lo);
+    hi = fm->C[c] + fm_occ(fm, c, hi);
+  }
+  fm_backtrack(s, sts->hash_offset - 1, lo, hi, mmatch);
+}
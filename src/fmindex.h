@@ -0,0 +1,73 @@
+#ifndef __fmindex_h__
+#define __fmindex_h__
+
+#include "stsmatch.h"
+
+/*
+ * FM-index of a sequence file for the fm engine (E=fm).  The index is
+ * built from the FASTA file once and saved (by default as
+ * seqfile.fmi); later runs against the same file map it instead of
+ * reading and scanning the sequences, so a search costs time in
+ * proportion to the number of primers and their hits, not to the
+ * length of the genome.
+ *
+ * The text is every sequence as parsed (see FastaFile::ParseText),
+ * each followed by a '\0', and a terminating '\0'.  The index alphabet
+ * is $ (the terminator), A, C, G, T and "anything else" (symbols 0 to
+ * 5).  The index file is the epcr_fm_header_t below followed by the
+ * sections of epcr_fm_index_t, in order and 8-byte aligned, in the
+ * byte order of the machine that built it.
+ */
+
+#define ePCR_FM_SYMBOLS  6    // $, A, C, G, T, other
+#define ePCR_FM_OCC_RATE 64   // BWT positions per occurrence count checkpoint
+#define ePCR_FM_SA_RATE  32   // text positions per suffix array sample
+#define ePCR_FM_INDEX_SUFFIX ".fmi"
+
+typedef struct {
+  char magic[8];                    // "ePCRfm1" (see fmindex.cpp)
+  unsigned long long source_size;   // size and modification time of
+  unsigned long long source_mtime;  // the sequence file indexed
+  unsigned long long size;          // bytes after the header
+  unsigned byte_order;              // 0x01020304 as written
+  unsigned n;
+  unsigned num_seqs;
+  unsigned labels_size;
+} epcr_fm_header_t;
+
+typedef struct epcr_fm_index {
+  unsigned n;              // text length, separators and terminator included
+  unsigned num_seqs;
+  unsigned labels_size;
+  unsigned *seq_start;     // offset of each sequence in text
+  unsigned *seq_len;
+  unsigned *label_offset;  // offset of each sequence's label in labels
+  unsigned *C;             // C[c] = number of symbols < c in the text
+  char *labels;
+  char *text;              // followed by some padding for the kernels' loads
+  unsigned char *bwt;      // one symbol per byte
+  unsigned *occ;           // occ[5*b+c-1] = count of symbol c in bwt[0, b*ePCR_FM_OCC_RATE)
+  unsigned long long *sampled;  // bit r%64 of sampled[r/64] set if row r has a sample
+  unsigned *sample_rank;   // samples in rows before 64*i
+  unsigned *samples;       // suffix array entries of the sampled rows, in row order
+
+  void *block;             // the sections above
+  size_t block_size;
+  int mapped;              // block is mapped from the index file, not allocated
+} epcr_fm_index_t;
+
+epcr_fm_index_t *ePCR_FmOpen (const char *seqfile, const char *indexfile);
+void ePCR_FmClose (epcr_fm_index_t *fm);
+
+typedef struct {
+  unsigned *pos;     // text positions
+  size_t num;
+  size_t allocated;
+} epcr_fm_hits_t;
+
+// Append to hits the text positions of all the places the left primer
+// of sts may match (see fmindex.cpp); Match() has the last word.
+void ePCR_FmFindLeft (const epcr_fm_index_t *fm, const STS *sts, unsigned wsize, int mmatch,
+		      epcr_fm_hits_t &hits);
+
+#endif
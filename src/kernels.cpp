@@ -0,0 +1,1491 @@
+///////////////////////////////////////////////////////////////////
+//
+//		Multithreaded Electronic PCR (me-PCR) program
+//
+//		Search kernels.  This file is compiled once per
+//		instruction set (see the makefile); EPCR_ISA names the
+//		variant and the compiler flags decide what it may use.
+//		Everything here except the kernel table must stay
+//		static, so that code built for one instruction set can
+//		never be linked into another variant.
+//
+///////////////////////////////////////////////////////////////////
+
+#include <assert.h>
+#include <time.h>
+
+#ifdef TIME_TRIAL
+#include <math.h>
+#endif
+
+#if defined(__SSSE3__) || defined(__SSE4_2__)
+#include <immintrin.h>
+#endif
+
+#include "kernels.h"
+
+#ifdef DMALLOC
+#include "dmalloc.h"
+#endif
+
+#ifndef EPCR_ISA
+#define EPCR_ISA generic
+#define EPCR_ISA_LEVEL ePCR_ISA_GENERIC
+#endif
+
+#define KERNEL_PASTE2(a,b) a##_##b
+#define KERNEL_PASTE(a,b)  KERNEL_PASTE2(a,b)
+#define KERNEL(name)       KERNEL_PASTE(name,EPCR_ISA)
+#define KERNEL_STRING2(a)  #a
+#define KERNEL_STRING(a)   KERNEL_STRING2(a)
+
+
+// Return 0 if two short pieces of sequence match, -1 otherwise,
+// subject to mmatch (number of allowed mismatches) and three_prime_match
+// (number of bases at the 3' end which MUST match).
+// See also seqmcmp_ambig below.
+// Note that an 'N' in either primer or sequence can only match an 'N',
+// so essentially, any STS with an N in it is only going to be found
+// with N (mismatches) > 0.
+// s2 is the STS string; s1 is the underlying sequence.
+// strand is +1 if the 3' end is on the right and -1 if the 3' end is on the left.
+static inline int seqmcmp (const epcr_search_t *search, const char *s1, const char *s2, int len, int strand)
+{
+  const char *p1 = s1;
+  const char *p2 = s2;
+  int i, n;
+  int mmatch = search->mmatch;
+  unsigned three_prime_match = search->three_prime_match;
+
+  // Check mmatch so we can do slightly less work if the N parameter is 0
+  if (mmatch != 0) {
+    for (i=n=0; i<len; i++, p1++, p2++)
+      {
+	assert (*p1 != 0 && *p2 != 0);
+	if (*p1 != *p2)
+	  {
+	    n++;
+	    if (n>mmatch
+		|| (strand > 0 && i >= len-three_prime_match)
+		|| (strand < 0 && i < three_prime_match)
+		)
+	      // No match if:
+	      // *) we exceed the total allowed mismatches per primer, OR
+	      // *) there is any mismatch with three_prime_match bases of
+	      // the 3' end of the primer.
+	      return -1;
+	  }
+      }
+    return 0;   // 0 means it matches (like strcmp)
+  } else {
+    for (i=0; i<len; i++, p1++, p2++)
+      {
+	assert (*p1 != 0 && *p2 != 0);
+	if (*p1 != *p2)
+	  return -1;
+      }
+    return 0;   // 0 means it matches (like strcmp)
+  }
+}
+
+
+
+// Version of seqmcmp (above) that interprets ambiguous base symbols in the STS properly.
+// s1 is the underlying sequence; set holds the nucleotide set of each
+// base of the STS primer (STS::p1_iupac or p2_iupac).  A base matches if
+// its own set (from _IUPAC_bits) has nothing outside the primer's.
+static inline int seqmcmp_ambig (const epcr_search_t *search, const char *s1, const unsigned char *set, int len, int strand)
+{
+  const char *p1 = s1;
+  const unsigned char *p2 = set;
+  int i, n;
+  int mmatch = search->mmatch;
+  unsigned three_prime_match = search->three_prime_match;
+
+  // Check mmatch so we can do slightly less work if the N parameter is 0
+  if (mmatch != 0) {
+    for (i=n=0; i<len; i++, p1++, p2++)
+      {
+	assert (*p1 != 0);
+	if (_IUPAC_bits[(unsigned char)*p1] & ~*p2)
+	  {
+	    n++;
+	    if (n>mmatch
+		|| (strand > 0 && i >= len-three_prime_match)
+		|| (strand < 0 && i < three_prime_match)
+		)
+	      // No match if:
+	      // *) we exceed the total allowed mismatches per primer, OR
+	      // *) there is any mismatch with three_prime_match bases of
+	      // the 3' end of the primer.
+	      return -1;
+	  }
+      }
+    return 0;   // 0 means it matches (like strcmp)
+  } else {
+    for (i=0; i<len; i++, p1++, p2++)
+      {
+	assert (*p1 != 0);
+	if (_IUPAC_bits[(unsigned char)*p1] & ~*p2)
+	  return -1;
+      }
+    return 0;   // 0 means it matches (like strcmp)
+  }
+}
+
+
+#if defined(__AVX512BW__) || defined(__SSE4_2__)
+
+// Vectorized primer comparison.  mismatch_bits() returns a mask with
+// bit i set if s1[i] != s2[i], for primers of MISMATCH_BITS_MIN to 64
+// bases; iupac_mismatch_bits() does the same for seqmcmp_ambig()'s
+// rule, expanding the sequence to nucleotide sets with a byte shuffle
+// through the 'A'..'_' rows of _IUPAC_bits.  Exactly the bytes
+// [0,len) of both strings are read, the same as the scalar loops
+// above: AVX-512 uses masked loads, and the SSE/AVX2 versions finish
+// with a block that overlaps the previous one and ends at len
+// (comparing a byte twice does no harm to an OR).  With the per-primer
+// 3' mask computed by PCRmachine::InsertSTS(), the match rule of
+// seqmcmp() becomes two bit operations (see mismatch_verdict()).
+#define HAVE_MISMATCH_BITS 1
+
+#if defined(__AVX512BW__)
+
+#define MISMATCH_BITS_MIN 1
+
+static inline __mmask64 len_mask (int len)
+{
+  return (len >= 64) ? ~(__mmask64)0 : (((__mmask64)1 << len) - 1);
+}
+
+static inline unsigned long long mismatch_bits (const char *s1, const char *s2, int len)
+{
+  __mmask64 k = len_mask(len);
+  __m512i a = _mm512_maskz_loadu_epi8(k, s1);
+  __m512i b = _mm512_maskz_loadu_epi8(k, s2);
+  return (unsigned long long) _mm512_mask_cmpneq_epi8_mask(k, a, b);
+}
+
+static inline unsigned long long iupac_mismatch_bits (const char *s1, const unsigned char *set, int len)
+{
+  __mmask64 k = len_mask(len);
+  __m512i v = _mm512_maskz_loadu_epi8(k, s1);
+  __m512i lo = _mm512_and_si512(v, _mm512_set1_epi8(0x0F));
+  __m512i hi = _mm512_and_si512(_mm512_srli_epi16(v, 4), _mm512_set1_epi8(0x0F));
+  __m512i row4 = _mm512_maskz_broadcast_i32x4(0xFFFF, _mm_loadu_si128((const __m128i *)(_IUPAC_bits + 0x40)));
+  __m512i row5 = _mm512_maskz_broadcast_i32x4(0xFFFF, _mm_loadu_si128((const __m128i *)(_IUPAC_bits + 0x50)));
+  __m512i bits = _mm512_set1_epi8(0x10);
+  bits = _mm512_mask_shuffle_epi8(bits, _mm512_cmpeq_epi8_mask(hi, _mm512_set1_epi8(4)), row4, lo);
+  bits = _mm512_mask_shuffle_epi8(bits, _mm512_cmpeq_epi8_mask(hi, _mm512_set1_epi8(5)), row5, lo);
+  __m512i p = _mm512_maskz_loadu_epi8(k, set);
+  return (unsigned long long) _mm512_mask_cmpneq_epi8_mask(k, _mm512_or_si512(bits, p), p);
+}
+
+#else
+
+#define MISMATCH_BITS_MIN 16
+
+typedef unsigned long long (*block_bits_t) (const char *s1, const char *s2);
+
+static inline unsigned long long mismatch_bits16 (const char *s1, const char *s2)
+{
+  __m128i eq = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)s1), _mm_loadu_si128((const __m128i *)s2));
+  return (unsigned long long)(~(unsigned)_mm_movemask_epi8(eq) & 0xFFFF);
+}
+
+// s2 is a primer's nucleotide sets here
+static inline unsigned long long iupac_mismatch_bits16 (const char *s1, const char *s2)
+{
+  __m128i v = _mm_loadu_si128((const __m128i *)s1);
+  __m128i lo = _mm_and_si128(v, _mm_set1_epi8(0x0F));
+  __m128i hi = _mm_and_si128(_mm_srli_epi16(v, 4), _mm_set1_epi8(0x0F));
+  __m128i in4 = _mm_cmpeq_epi8(hi, _mm_set1_epi8(4));
+  __m128i in5 = _mm_cmpeq_epi8(hi, _mm_set1_epi8(5));
+  __m128i bits = _mm_or_si128(
+    _mm_or_si128(_mm_and_si128(in4, _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(_IUPAC_bits + 0x40)), lo)),
+		 _mm_and_si128(in5, _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(_IUPAC_bits + 0x50)), lo))),
+    _mm_andnot_si128(_mm_or_si128(in4, in5), _mm_set1_epi8(0x10)));
+  bits = _mm_andnot_si128(_mm_loadu_si128((const __m128i *)s2), bits);
+  __m128i ok = _mm_cmpeq_epi8(bits, _mm_setzero_si128());
+  return (unsigned long long)(~(unsigned)_mm_movemask_epi8(ok) & 0xFFFF);
+}
+
+#if defined(__AVX2__)
+static inline unsigned long long mismatch_bits32 (const char *s1, const char *s2)
+{
+  __m256i eq = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)s1), _mm256_loadu_si256((const __m256i *)s2));
+  return (unsigned long long)(~(unsigned)_mm256_movemask_epi8(eq));
+}
+
+static inline unsigned long long iupac_mismatch_bits32 (const char *s1, const char *s2)
+{
+  __m256i v = _mm256_loadu_si256((const __m256i *)s1);
+  __m256i lo = _mm256_and_si256(v, _mm256_set1_epi8(0x0F));
+  __m256i hi = _mm256_and_si256(_mm256_srli_epi16(v, 4), _mm256_set1_epi8(0x0F));
+  __m256i in4 = _mm256_cmpeq_epi8(hi, _mm256_set1_epi8(4));
+  __m256i in5 = _mm256_cmpeq_epi8(hi, _mm256_set1_epi8(5));
+  __m256i row4 = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)(_IUPAC_bits + 0x40)));
+  __m256i row5 = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)(_IUPAC_bits + 0x50)));
+  __m256i bits = _mm256_or_si256(
+    _mm256_or_si256(_mm256_and_si256(in4, _mm256_shuffle_epi8(row4, lo)),
+		    _mm256_and_si256(in5, _mm256_shuffle_epi8(row5, lo))),
+    _mm256_andnot_si256(_mm256_or_si256(in4, in5), _mm256_set1_epi8(0x10)));
+  bits = _mm256_andnot_si256(_mm256_loadu_si256((const __m256i *)s2), bits);
+  __m256i ok = _mm256_cmpeq_epi8(bits, _mm256_setzero_si256());
+  return (unsigned long long)(~(unsigned)_mm256_movemask_epi8(ok));
+}
+#define BLOCK 32
+#else
+#define BLOCK 16
+#endif
+
+// Put together the mask for a whole primer from 16-byte and BLOCK-byte
+// pieces
+static inline unsigned long long block_bits (const char *s1, const char *s2, int len,
+					     block_bits_t bits16, block_bits_t bits_block)
+{
+  unsigned long long mm = 0;
+  int o;
+
+  if (len < BLOCK)   // only possible for AVX2: 16 <= len < 32
+    return bits16(s1, s2) | (bits16(s1+len-16, s2+len-16) << (len-16));
+
+  for (o=0; o+BLOCK<=len; o+=BLOCK)
+    mm |= bits_block(s1+o, s2+o) << o;
+  if (o < len)
+    mm |= bits_block(s1+len-BLOCK, s2+len-BLOCK) << (len-BLOCK);
+  return mm;
+}
+
+static inline unsigned long long mismatch_bits (const char *s1, const char *s2, int len)
+{
+#if BLOCK == 32
+  return block_bits(s1, s2, len, mismatch_bits16, mismatch_bits32);
+#else
+  return block_bits(s1, s2, len, mismatch_bits16, mismatch_bits16);
+#endif
+}
+
+static inline unsigned long long iupac_mismatch_bits (const char *s1, const unsigned char *set, int len)
+{
+#if BLOCK == 32
+  return block_bits(s1, (const char *)set, len, iupac_mismatch_bits16, iupac_mismatch_bits32);
+#else
+  return block_bits(s1, (const char *)set, len, iupac_mismatch_bits16, iupac_mismatch_bits16);
+#endif
+}
+
+#undef BLOCK
+
+#endif // __AVX512BW__
+
+
+// 0 if the mismatches in mm are allowed, -1 if not (see seqmcmp())
+static inline int mismatch_verdict (const epcr_search_t *search, unsigned long long mm, unsigned long long three_prime_mask)
+{
+  if (mm == 0)
+    return 0;
+  if (__builtin_popcountll(mm) > search->mmatch || (mm & three_prime_mask))
+    return -1;
+  return 0;
+}
+
+#endif // __AVX512BW__ || __SSE4_2__
+
+
+#ifndef HAVE_MISMATCH_BITS
+
+// Verification of packed primers (see epcr_packed_primer_t in
+// stsmatch.h) for the kernels without a vector byte compare.  The
+// sequence is packed 8 bases at a time with plain 64-bit arithmetic,
+// using the same code as the primers: ((ascii >> 1) & 3).  Bytes other
+// than A, C, G and T have no code, so they are flagged separately and
+// count as mismatches, just as they do in seqmcmp().  A group of 8
+// mismatches is then an XOR, an OR of each base's two bits and a
+// popcount, and the X= test an AND with the primer's 3' mask.
+#define ONES8 0x0101010101010101ULL
+#define LOW7  0x7F7F7F7F7F7F7F7FULL
+#define HIGH8 0x8080808080808080ULL
+#define LANES 0x5555U
+
+// Read 8 bytes, s[0] in the low byte whatever the byte order
+static inline unsigned long long load8 (const char *s)
+{
+  const unsigned char *u = (const unsigned char *)s;
+  return (unsigned long long)u[0] | ((unsigned long long)u[1] << 8)
+    | ((unsigned long long)u[2] << 16) | ((unsigned long long)u[3] << 24)
+    | ((unsigned long long)u[4] << 32) | ((unsigned long long)u[5] << 40)
+    | ((unsigned long long)u[6] << 48) | ((unsigned long long)u[7] << 56);
+}
+
+// High bit of each byte set if that byte of x is zero
+static inline unsigned long long zero_bytes (unsigned long long x)
+{
+  return ~(((x & LOW7) + LOW7) | x | LOW7);
+}
+
+// Gather the low two bits of each byte of w into 16 bits (byte j to
+// bits 2j and 2j+1)
+static inline unsigned gather2 (unsigned long long w)
+{
+  w &= 0x0303030303030303ULL;
+  w |= w >> 6;  w &= 0x000F000F000F000FULL;
+  w |= w >> 12; w &= 0x000000FF000000FFULL;
+  w |= w >> 24;
+  return (unsigned)(w & 0xFFFF);
+}
+
+// The 16 bits of a packed primer word pair for bases [base,base+8)
+static inline unsigned get16 (const unsigned long long v[2], int base)
+{
+  int b = 2*base;
+  unsigned long long r;
+
+  if (b < 64) {
+    r = v[0] >> b;
+    if (b > 48)
+      r |= v[1] << (64-b);
+  } else
+    r = v[1] >> (b-64);
+  return (unsigned)(r & 0xFFFF);
+}
+
+static inline int popcount16 (unsigned x)
+{
+#if defined(__GNUC__)
+  return __builtin_popcount(x);
+#else
+  x = x - ((x >> 1) & 0x5555);
+  x = (x & 0x3333) + ((x >> 2) & 0x3333);
+  x = (x + (x >> 4)) & 0x0F0F;
+  return (int)((x + (x >> 8)) & 0x1F);
+#endif
+}
+
+static inline int packed_cmp (const epcr_search_t *search, const char *seq, const epcr_packed_primer_t *p, int len)
+{
+  int n = 0;
+  int o, start;
+
+  for (o=0; o<len; o+=8) {
+    // The last group overlaps the one before it and ends at len, so we
+    // never read past the primer; keep only the bases not yet counted.
+    unsigned keep = 0xFFFF;
+    start = o;
+    if (o+8 > len) {
+      start = len-8;
+      keep <<= 2*(o-start);
+    }
+
+    unsigned long long w = load8(seq+start);
+    unsigned x = gather2(w >> 1) ^ get16(p->bases, start);
+    unsigned m = ((x | (x >> 1)) & LANES) & keep;
+
+    // Most comparisons fail on the codes alone.  Only the ones that
+    // survive need the bytes without a code (N, IUPAC symbols, ...)
+    // counted among the remaining bases.
+    if (m) {
+      n += popcount16(m);
+      if (n > search->mmatch || (m & get16(p->three_prime, start)))
+	return -1;
+    }
+    unsigned long long ok = zero_bytes(w ^ (ONES8*'A')) | zero_bytes(w ^ (ONES8*'C'))
+      | zero_bytes(w ^ (ONES8*'G')) | zero_bytes(w ^ (ONES8*'T'));
+    if ((ok & HIGH8) != HIGH8) {
+      m = gather2((~ok & HIGH8) >> 7) & keep & ~m;
+      n += popcount16(m);
+      if (n > search->mmatch || (m & get16(p->three_prime, start)))
+	return -1;
+    }
+  }
+  return 0;
+}
+
+#undef ONES8
+#undef LOW7
+#undef HIGH8
+#undef LANES
+
+#endif // !HAVE_MISMATCH_BITS
+
+
+// Compare one primer of sts (PRIMER1, whose 3' end is on the right, or
+// PRIMER2, the reversed right primer) with the sequence at seq.  Returns
+// 0 for a match and -1 otherwise, like seqmcmp().
+static inline int primer_cmp (const epcr_search_t *search, const char *seq, const STS *sts, int primer)
+{
+  const char *p = (primer == PRIMER1) ? sts->pcr_p1 : sts->pcr_p2;
+  int len = (primer == PRIMER1) ? sts->p1_len : sts->p2_len;
+  int strand = (primer == PRIMER1) ? +1 : -1;
+
+  if (sts->ambig_primer & primer) {
+    const unsigned char *set = (primer == PRIMER1) ? sts->p1_iupac : sts->p2_iupac;
+#ifdef HAVE_MISMATCH_BITS
+    if (len >= MISMATCH_BITS_MIN && len <= 64)
+      return mismatch_verdict(search, iupac_mismatch_bits(seq, set, len),
+			      (primer == PRIMER1) ? sts->p1_3prime_mask : sts->p2_3prime_mask);
+#endif
+    return seqmcmp_ambig(search, seq, set, len, strand);
+  }
+
+#ifndef HAVE_MISMATCH_BITS
+  if (sts->packed_primer & primer)
+    return packed_cmp(search, seq, (primer == PRIMER1) ? &sts->p1_packed : &sts->p2_packed, len);
+#endif
+
+#ifdef HAVE_MISMATCH_BITS
+  if (len >= MISMATCH_BITS_MIN && len <= 64)
+    return mismatch_verdict(search, mismatch_bits(seq, p, len),
+			    (primer == PRIMER1) ? sts->p1_3prime_mask : sts->p2_3prime_mask);
+#endif
+
+  return seqmcmp(search, seq, p, len, strand);
+}
+
+
+// Work out where Match() looks for the right primer, given that
+// seq_len bases of sequence remain from the start of the left primer:
+// the expected product size (cut down near the end of the sequence)
+// and the margins below and above it.  Returns FALSE if the STS can't
+// fit at all.
+static inline int margin_window (const STS *sts, size_t seq_len,
+				 size_t &exp_size, size_t &lo_margin, size_t &hi_margin)
+{
+  size_t len_p1 = sts->p1_len;
+  size_t len_p2 = sts->p2_len;
+  size_t margin = sts->margin;
+
+  exp_size = sts->pcr_size;
+
+  // boundary check: we're not allowed to start looking after the end of the sequence!
+  if (exp_size > seq_len) {
+
+    // We'd like to coerce exp_size, but let's see if we can even do that ...
+
+    if (seq_len < len_p1 + len_p2)
+      // no, this STS can't possibly fit this close to the end of the sequence
+      return FALSE;
+
+    // yes, set exp_size to the maximum possible value
+    exp_size = seq_len;
+    hi_margin = 0;
+
+  } else {
+
+    // Keep exp_size the same, and ...
+    hi_margin = margin;
+    // Make sure that hi_margin will not extend our search beyond the sequence end.
+    if ( (hi_margin + exp_size) > seq_len)
+      hi_margin = seq_len - exp_size;   // Note that in this if clause we are guaranteed that seq_len >= exp_size
+  }
+
+  // assert: seq_len >= exp_size
+
+  lo_margin = margin;
+  if (lo_margin > exp_size - len_p1 - len_p2)
+    lo_margin = exp_size - len_p1 - len_p2;
+
+  // assert: lo_margin >= 0, because when the STS was created, exp_size was coerced to be >= len_p1 + len_p2
+
+  assert ((int)seq_len >= (exp_size-lo_margin));
+  return TRUE;
+}
+
+
+/*
+  margin_search()
+
+  Bit-parallel search for the right primer across the whole margin
+  window, for Match().  Rather than comparing the primer at exp_size,
+  exp_size-1, exp_size+1, ... one position at a time, it runs the
+  shift-and algorithm with k = N mismatches over the window once:
+  R[j] has bit i set if the first i+1 bases of the primer match the
+  text just read with at most j mismatches, none of them at a position
+  in the primer's X= mask.  That is exactly the rule of seqmcmp() (and
+  of seqmcmp_ambig(), since B[] is built from the IUPAC sets), so the
+  hits are the same.  They are found from left to right, and recorded
+  in Match()'s order: exp_size first, then -1, +1, -2, +2, ...  The
+  hits on the low side are held back until the high side catches up.
+
+  Primers longer than 64 bases, plain primers with anything but the
+  letters A-Z, and windows with more than MAX_LO_HITS hits on the low
+  side are left to the one-at-a-time loop: the return value is -1 and
+  nothing has been recorded.  Otherwise it is the number of hits.
+ */
+#define BITPARALLEL_MIN_MARGIN 16   // below this the loop is as fast
+#define MAX_LO_HITS 64
+
+// 1 to 26 for 'A' to 'Z', 0 for anything else
+#define LETTER_CLASS(c) ((unsigned char)((c) - 'A') < 26 ? (unsigned char)((c) - 'A') + 1 : 0)
+
+static inline int margin_search (
+				 const epcr_search_t *search,
+				 const char *seq,
+				 int k,
+				 const STS *sts,
+				 size_t exp_size,
+				 size_t lo_margin,
+				 size_t hi_margin,
+				 epcr_thread_args_t *args
+				 )
+{
+  int m = sts->p2_len;
+  int mmatch = search->mmatch;
+  unsigned long long B[27], R[ePCR_MMATCH_MAX+1];
+  unsigned long long last;
+  unsigned long long allowed = ~sts->p2_3prime_mask;
+  size_t lo_hits[MAX_LO_HITS];
+  int num_lo = 0, count = 0;
+  size_t n, idx;
+  int i, j;
+
+  if (m > 64)
+    return -1;
+  last = 1ULL << (m-1);
+
+  // B[c] has bit i set if a sequence letter of class c matches base i
+  memset (B, 0, sizeof(B));
+  if (sts->ambig_primer & PRIMER2) {
+    for (i=0; i<m; i++)
+      for (const char *q = _IUPAC_letters[sts->p2_iupac[i]]; *q; q++)
+	B[LETTER_CLASS(*q)] |= 1ULL << i;
+  } else {
+    for (i=0; i<m; i++) {
+      int c = LETTER_CLASS(sts->pcr_p2[i]);
+      if (c == 0)
+	return -1;
+      B[c] |= 1ULL << i;
+    }
+  }
+
+  // The window holds the primer at offsets -lo_margin .. +hi_margin
+  // from exp_size; idx-m+1 is the offset of the last primer position
+  // read, plus lo_margin.
+  const char *t = seq + exp_size - m - lo_margin;
+  n = lo_margin + hi_margin + m;
+  memset (R, 0, sizeof(R));
+
+#ifdef EPCR_STATS
+  args->string_comparisons += lo_margin + hi_margin + 1;
+#endif
+
+  for (idx=0; idx<n; idx++) {
+    unsigned long long b = B[LETTER_CLASS(t[idx])];
+    unsigned long long prev = R[0];
+    R[0] = ((R[0] << 1) | 1) & b;
+    for (j=1; j<=mmatch; j++) {
+      unsigned long long cur = R[j];
+      R[j] = (((cur << 1) | 1) & b) | (((prev << 1) | 1) & allowed);
+      prev = cur;
+    }
+
+    if (R[mmatch] & last) {
+      size_t start = idx - (m-1);   // offset + lo_margin
+      if (start < lo_margin) {
+	if (num_lo == MAX_LO_HITS)
+	  return -1;
+	lo_hits[num_lo++] = lo_margin - start;
+      } else {
+	size_t hi = start - lo_margin;
+	// Everything on the low side that comes first in Match()'s
+	// order: up to and including -hi (nothing before exp_size itself)
+	while (hi > 0 && num_lo > 0 && lo_hits[num_lo-1] <= hi) {
+	  num_lo--;
+	  PCRmachine::RecordHit(args, k, k+exp_size-lo_hits[num_lo]-1, sts);
+	  count++;
+	}
+	PCRmachine::RecordHit(args, k, k+exp_size+hi-1, sts);
+	count++;
+      }
+    }
+  }
+
+  while (num_lo > 0) {
+    num_lo--;
+    PCRmachine::RecordHit(args, k, k+exp_size-lo_hits[num_lo]-1, sts);
+    count++;
+  }
+  return count;
+}
+
+#undef LETTER_CLASS
+
+
+// The part of Match() after the left primer has matched: look for
+// the right primer.  Also used directly by the ac engine, which finds
+// the left primers itself.
+static inline int MatchRight (
+			 const epcr_search_t *search,
+			 const char *seq,  // Pointer to the beginning of the left primer in the sequence
+			 size_t seq_len,   // Length of entire remaining sequence
+			 int k,            // k indexes the first character of the primer
+			 const STS *sts,   // The STS we're looking for
+			 epcr_thread_args_t *args  // For storing statistics
+			 )
+{
+   size_t margin = sts->margin;
+   int count = 0;
+   size_t len_p2 = sts->p2_len;
+   size_t exp_size, lo_margin, hi_margin;
+
+   if (!margin_window(sts, seq_len, exp_size, lo_margin, hi_margin))
+	return 0;
+
+   if (margin >= BITPARALLEL_MIN_MARGIN) {
+	int n = margin_search(search, seq, k, sts, exp_size, lo_margin, hi_margin, args);
+	if (n >= 0)
+	  return n;
+   }
+
+#ifdef EPCR_STATS
+  args->string_comparisons++;
+#endif
+
+   const char *p = seq + (exp_size - len_p2);
+   if (seq_len>=exp_size && primer_cmp(search,p,sts,PRIMER2)==0)
+	{
+	   PCRmachine::RecordHit(args, k, k+exp_size-1, sts);
+	   count++;
+	}
+
+   size_t i;
+   for (i=1; i<=margin; ++i)
+	{
+#ifdef EPCR_STATS
+  args->string_comparisons++;
+#endif
+	  if (i<=lo_margin && primer_cmp(search,p-i,sts,PRIMER2)==0)
+	     {
+		PCRmachine::RecordHit(args, k, k+exp_size-i-1, sts);
+		count++;
+	     }
+#ifdef EPCR_STATS
+	   args->string_comparisons++;
+#endif
+	  if (i<=hi_margin && primer_cmp(search,p+i,sts,PRIMER2)==0)
+	     {
+		PCRmachine::RecordHit(args, k, k+exp_size+i-1, sts);
+		count++;
+	     }
+	}
+   return count;
+}
+
+
+/*
+  Match()
+
+  Once a hash hit on the left primer has occurred, Match() determines
+  via brute force whether the whole STS matches the underlying
+  sequence.  In doing so, Match() uses the expected PCR size and
+  allowable margin (M) to find the right primer.  In the worst case,
+  Match() will perform 2*M+1 string comparisons (via seqmcmp()) trying
+  to find the right primer; for larger margins margin_search() covers
+  the same positions in a single pass.
+
+  Note: Match() always starts its search at the expected PCR size and
+  gradually widens its search from there.  This makes sense since the
+  graph of found versus expected size is a steep bell curve centered
+  on the expected size.
+
+  Note: There is various annoying logic here which prevents Match()
+  from searching before the beginning of left primer (and hence,
+  indirectly, before the beginning of the entire sequence, yikes) and
+  also from searching beyond the end of the entire sequence.
+
+  Hits are recorded by calling PCRmachine::RecordHit() as they are
+  encountered.
+
+ Return value: the number of hits.
+
+ */
+static inline int Match (
+			 const epcr_search_t *search,
+			 const char *seq,  // Pointer to the beginning of the left primer in the sequence
+			 size_t seq_len,   // Length of entire remaining sequence
+			 int k,            // k indexes the first character of the primer
+			 const STS *sts,   // The STS we're looking for
+			 epcr_thread_args_t *args  // For storing statistics
+			 )
+{
+#ifdef EPCR_STATS
+   args->string_comparisons++;
+#endif
+
+  if (primer_cmp(search,seq,sts,PRIMER1)==0)
+    return MatchRight(search, seq, seq_len, k, sts, args);
+  return 0;
+}
+
+
+// Shift base c into the rolling word hash h (2 bits per base, masked
+// to the word size).  If c is ambiguous (e.g. "N") the hash is
+// disqualified for wsize bases after that: N counts down to 0, the
+// first position with a valid hash again.  Shared by the scan engines.
+static inline void roll_hash (unsigned int &h, int &N, char c, unsigned int mask, unsigned int wsize)
+{
+  int j;
+
+  h <<= 2;
+  h &= mask;
+  if ((j=_scode[c]) == AMBIG)
+    N = wsize;
+  else
+    {
+      if (N>0) N--;
+      h |= (unsigned int) j;
+    }
+}
+
+
+/* This is the actual search algorithm
+ * seq_data is upcased, whitespace-stripped sequence data
+ * _scode is an array of 128 bytes, with ACGT mapped to 0,1,2,3, and everything else
+ * mapped to 100 (AMBIG).
+ */
+static int KERNEL(scan) (const epcr_search_t *search, epcr_thread_args_t *args)
+{
+  size_t seq_len = args->length;
+  const char * seq_data = args->data;
+  STS **sts_table = search->sts_table;
+  unsigned int wsize = search->wsize;
+  unsigned int mask = search->mask;
+  unsigned long shard_first = args->shard_first, shard_last = args->shard_last;
+  int count = 0;
+#ifdef TIME_TRIAL
+  time_t start_time = time(NULL);
+#endif
+#ifdef EPCR_STATS
+  const STS *last_sts = NULL;
+#endif
+
+  if (seq_data && seq_len > args->scan_begin + wsize)
+    {
+      unsigned int h;
+      const char *p = seq_data + args->scan_begin;
+      int i, k, pos, N;
+      int end = (int) args->scan_end;
+
+      /* kpm: A nice simple hash.  Actually, we're just
+       * discarding the unused bits from each character and squeezing
+       * as many 2-bit symbols as possible into a variable.
+       */
+      for(i=N=0, h=0; (unsigned)i<wsize; i++)
+	roll_hash(h, N, *p++, mask, wsize);   /// Initialize the hash value h with the first
+
+      // Notice that pos is not involved in loop termination
+      // and that throughout the loop,
+      // pos = (p-wsize) - seq_data
+      // i.e., pos is "wsize behind p".
+      // First time through, pos=scan_begin and p=seq_data+scan_begin+wsize.
+
+      for (pos=(int)args->scan_begin; (size_t)(p-seq_data)<seq_len && pos<end; ++pos)
+	{
+	  // If N > 0, it means there was an N within the last wsize
+	  // characters, so we know we don't have a valid hash value
+	  // to test.  Other threads try the STS's of other shards.
+	  if (N == 0 && h >= shard_first && h <= shard_last)
+	    {
+	      STS *sts = sts_table[h];
+	      while (sts)
+		{
+#ifdef DEBUG
+		  fprintf (stderr, "hash hit: %s/%s\n", sts->pcr_p1, sts->pcr_p2);
+#endif
+#ifdef EPCR_STATS
+		  args->hash_hits++;
+#endif
+		  /*
+		   * When a hash match occurs, p points to the
+		   * character after the last character of the
+		   * wsize-sized match region, and pos indexes the
+		   * first character of the match region.
+		   *
+		   * k indexes the first character of the primer.
+		   *
+		   * Note: the comparison against 0 is rather
+		   * regrettable since it only applies to the first
+		   * handful out of millions of comparisons.  For real
+		   * speed we should prime the algorithm up to the
+		   * point where this comparison is not needed.
+		   */
+		  k = pos - sts->hash_offset;
+#ifdef EPCR_STATS
+		  if (k>=0 && sts != last_sts) {
+		    args->sts_switches++;
+		    last_sts = sts;
+		  }
+#endif
+		  if (k>=0)
+		     count += Match(
+				    search,
+				    seq_data+k,
+				    seq_len-k,
+				    k,
+				    sts,
+				    args
+				    );
+		  sts = sts->next;
+		}  // end while
+#ifdef EPCR_STATS
+	      args->comparisons++;
+#endif
+	    }  // end if N==0
+
+	  // Update the hash value.  If an ambiguous base (e.g. "N")
+	  // is encountered, the hash is disqualified for wordsize
+	  // bases after that.  We don't automatically forward the
+	  // pointers by wordsize, but it doesn't seem to affect the
+	  // speed.  Interestingly, it doesn't really pay to try to scan
+	  // for an entire block of N's here.  And it will only pay less
+	  // and less as time goes on ... so we won't.
+	  roll_hash(h, N, *p++, mask, wsize);
+
+#ifdef TIME_TRIAL
+			// For the Mac, allow e-PCR to operate in the background and play nice
+#ifdef __MWERKS__
+	  TimeSlice();
+#endif
+
+	  // Output a progress indication
+	  if (!ePCR_quiet) {
+	    static int percent_done;
+	    static clock_t last_clock;
+	    clock_t this_clock;
+	    float fract;
+	    if ((this_clock = clock()) != last_clock) {
+	      last_clock = this_clock;
+	      fract = (float)(p-seq_data)/seq_len;
+	      if (fract > percent_done/100.0) {
+		percent_done  = (int) ceil(fract*100);
+		fprintf (stderr, "\t%3d %% done; time spent: %d secs; hash hits: %lu; hash looks: %lu\n",
+			 percent_done-1, (int) (time(NULL)-start_time), args->hash_hits, args->comparisons);
+	      }
+	    }
+	  }
+#endif // TIME_TRIAL
+	}
+    }
+
+  return count;
+}
+
+
+/* The join engine (E=join)
+ *
+ * One pass over the sequence looks up every word in both hash tables:
+ * search->sts_table gives left primer seeds, as in the scan above, and
+ * search->sts_table_right (see PCRmachine::BuildJoinTable) gives right
+ * primer seeds.  The two lists are then sorted by STS and position and
+ * joined: only a left seed with a right seed inside its product size
+ * window (margin_window()) is verified, and then only at the right
+ * seeds instead of at all 2*M+1 positions.  STS's whose right primer
+ * can't be seeded go through Match() as usual.  The hits end up in
+ * the scan's order via PCRmachine::SortHits(), so the output is the same.
+ *
+ * To bound the memory used for the seed lists, the sequence is joined
+ * a window of left seeds at a time.  A right primer starts after its
+ * left primer and ends at most search->overlap bases after it, so the
+ * right seeds of a window are collected over the window widened by
+ * overlap+1 words on either side.
+ */
+#ifndef ePCR_JOIN_WINDOW
+#define ePCR_JOIN_WINDOW (1 << 18)   // minimum window, in words
+#endif
+
+typedef struct {
+  const STS *sts;
+  size_t pos;    // start of the primer in the sequence
+} seed_hit_t;
+
+typedef struct {
+  seed_hit_t *list;
+  size_t num;
+  size_t allocated;
+} seed_list_t;
+
+static int compare_seed_hits (const void *a, const void *b)
+{
+  const seed_hit_t *x = (const seed_hit_t *) a;
+  const seed_hit_t *y = (const seed_hit_t *) b;
+
+  if (x->sts != y->sts)
+    return x->sts < y->sts ? -1 : 1;
+  if (x->pos != y->pos)
+    return x->pos < y->pos ? -1 : 1;
+  return 0;
+}
+
+static inline void add_seed_hit (seed_list_t &s, const STS *sts, size_t pos)
+{
+  if (s.num == s.allocated) {
+    size_t allocated = s.allocated ? 2*s.allocated : 1024;
+    if (allocated > ((size_t)-1) / sizeof(seed_hit_t)
+	|| !MemResize(s.list, allocated * sizeof(seed_hit_t))) {
+      fprintf (stderr, "Out of memory in the join engine\n");
+      exit(1);
+    }
+    s.allocated = allocated;
+  }
+  s.list[s.num].sts = sts;
+  s.list[s.num].pos = pos;
+  s.num++;
+}
+
+// Join the left and right seeds collected for one window of words
+// and verify the pairs that are the right distance apart.  With more
+// seeds than words (a small word size W) sorting them costs more than
+// the join saves, so the left seeds are simply verified with Match().
+static int join_seeds (const epcr_search_t *search, epcr_thread_args_t *args, seed_list_t &left, seed_list_t &right, size_t words)
+{
+  const char *seq_data = args->data;
+  size_t seq_len = args->length;
+  size_t l, r = 0;
+  int count = 0;
+
+  if (left.num == 0 || right.num == 0) {
+    left.num = right.num = 0;
+    return 0;
+  }
+
+  if (left.num + right.num > words) {
+    for (l=0; l<left.num; l++) {
+      size_t k = left.list[l].pos;
+      count += Match(search, seq_data+k, seq_len-k, (int)k, (STS *)left.list[l].sts, args);
+    }
+    left.num = right.num = 0;
+    return count;
+  }
+
+  qsort (left.list, left.num, sizeof(seed_hit_t), compare_seed_hits);
+  qsort (right.list, right.num, sizeof(seed_hit_t), compare_seed_hits);
+
+  for (l=0; l<left.num; ) {
+    const STS *sts = left.list[l].sts;
+    size_t l_end, r_begin, r_end;
+
+    for (l_end=l; l_end<left.num && left.list[l_end].sts == sts; l_end++)
+      ;
+    while (r < right.num && right.list[r].sts < sts)
+      r++;
+    for (r_begin=r; r<right.num && right.list[r].sts == sts; r++)
+      ;
+    r_end = r;
+
+    for (; r_begin < r_end && l < l_end; l++) {
+      size_t k = left.list[l].pos;
+      size_t exp_size, lo_margin, hi_margin, lo, hi, a, b;
+      int left_ok = -1;
+
+      if (!margin_window(sts, seq_len-k, exp_size, lo_margin, hi_margin))
+	continue;
+      lo = k + exp_size - sts->p2_len - lo_margin;
+      hi = k + exp_size - sts->p2_len + hi_margin;
+
+      // first right seed at or after lo
+      for (a=r_begin, b=r_end; a<b; ) {
+	size_t mid = a + (b-a)/2;
+	if (right.list[mid].pos < lo)
+	  a = mid+1;
+	else
+	  b = mid;
+      }
+
+      for (; a<r_end && right.list[a].pos <= hi; a++) {
+#ifdef EPCR_STATS
+	args->string_comparisons++;
+#endif
+	if (left_ok < 0)
+	  left_ok = primer_cmp(search, seq_data+k, sts, PRIMER1) == 0;
+	if (!left_ok)
+	  break;
+	if (primer_cmp(search, seq_data+right.list[a].pos, sts, PRIMER2) == 0) {
+	  PCRmachine::RecordHit(args, (int)k, (int)(right.list[a].pos + sts->p2_len - 1), sts);
+	  count++;
+	}
+      }
+    }
+    l = l_end;
+  }
+
+  left.num = right.num = 0;
+  return count;
+}
+
+static int KERNEL(scan_join) (const epcr_search_t *search, epcr_thread_args_t *args)
+{
+  size_t seq_len = args->length;
+  const char * seq_data = args->data;
+  STS **sts_table = search->sts_table;
+  STS **sts_table_right = search->sts_table_right;
+  unsigned int wsize = search->wsize;
+  unsigned int mask = search->mask;
+  unsigned long first = args->num_hits;
+  seed_list_t left = { NULL, 0, 0 }, right = { NULL, 0, 0 };
+  int count = 0;
+
+  if (seq_data && seq_len > args->scan_begin + wsize)
+    {
+      // The scan looks up the words at positions 0 .. seq_len-wsize-1
+      // (those from scan_begin to scan_end here); a right primer may
+      // also end in the last word.
+      size_t num_left = seq_len - wsize, num_words = num_left + 1;
+      size_t span = search->overlap + 1;
+      size_t window = (span > ePCR_JOIN_WINDOW/16) ? 16*span : ePCR_JOIN_WINDOW;
+      size_t w0, w1;
+
+      if (num_left > args->scan_end)
+	num_left = args->scan_end;
+      for (w0=args->scan_begin; w0<num_left; w0=w1)
+	{
+	  size_t from = (w0 > span) ? w0 - span : 0;
+	  size_t to, pos;
+	  unsigned int h;
+	  const char *p = seq_data + from;
+	  int i, N;
+
+	  w1 = (num_left - w0 > window) ? w0 + window : num_left;
+	  to = (num_words - w1 > span) ? w1 + span : num_words;
+
+	  for(i=N=0, h=0; (unsigned)i<wsize; i++)
+	    roll_hash(h, N, *p++, mask, wsize);
+
+	  // pos is "wsize behind p", as in the scan
+	  for (pos=from; pos<to; ++pos)
+	    {
+	      if (N == 0)
+		{
+		  STS *sts;
+		  if (pos >= w0 && pos < w1)
+		    for (sts = sts_table[h]; sts; sts = sts->next) {
+#ifdef EPCR_STATS
+		      args->hash_hits++;
+#endif
+		      if (pos < sts->hash_offset)
+			continue;
+		      size_t k = pos - sts->hash_offset;
+		      if (sts->p2_hash_offset < 0)
+			count += Match(search, seq_data+k, seq_len-k, (int)k, sts, args);
+		      else
+			add_seed_hit(left, sts, k);
+		    }
+		  for (sts = sts_table_right[h]; sts; sts = sts->next_right)
+		    if (pos >= (size_t)sts->p2_hash_offset)
+		      add_seed_hit(right, sts, pos - sts->p2_hash_offset);
+#ifdef EPCR_STATS
+		  if (pos >= w0 && pos < w1)
+		    args->comparisons++;
+#endif
+		}
+	      if (pos+1 < to)
+		roll_hash(h, N, *p++, mask, wsize);
+	    }
+
+	  count += join_seeds(search, args, left, right, to - from);
+	}
+    }
+
+  if (left.list) MemDealloc(left.list);
+  if (right.list) MemDealloc(right.list);
+
+  PCRmachine::SortHits(args, first);
+  return count;
+}
+
+
+/* The batch engine (E=batch)
+ *
+ * The scan above walks a bucket chain and calls Match() for every word
+ * as it comes, so with a large STS set nearly every word costs a cache
+ * miss in the hash table (most of them to find an empty bucket) and
+ * the verification jumps from one STS record and its primers to
+ * another.  This engine splits the work in two.  The scan only
+ * collects the positions of words whose bucket is occupied, which it
+ * can tell from search->occupied, a bitmap small enough to stay in the
+ * cache.  Every ePCR_BATCH_SIZE candidates, the batch is sorted by hash
+ * value (a stable radix sort, so positions stay in order) and each
+ * bucket chain is walked once: all the positions of one STS are
+ * verified in a row while its record and primers are in the cache.
+ * PCRmachine::SortHits() puts the hits back into the scan's order.
+ */
+#define ePCR_BATCH_SIZE 16384
+#define ePCR_BATCH_RADIX_BITS 11
+
+typedef struct {
+  unsigned int h;
+  unsigned int pos;
+} batch_word_t;
+
+typedef struct {
+  batch_word_t *words;
+  batch_word_t *tmp;    // radix sort buffer
+  size_t num;
+} batch_t;
+
+static int verify_batch (const epcr_search_t *search, epcr_thread_args_t *args, batch_t &b)
+{
+  const char *seq_data = args->data;
+  size_t seq_len = args->length;
+  unsigned count[1 << ePCR_BATCH_RADIX_BITS];
+  unsigned shift;
+  size_t i, j, n;
+  int hits = 0;
+
+  // LSD radix sort on the hash value
+  for (shift=0; shift < 2*search->wsize; shift += ePCR_BATCH_RADIX_BITS) {
+    unsigned d, sum = 0;
+    memset (count, 0, sizeof(count));
+    for (i=0; i<b.num; i++)
+      count[(b.words[i].h >> shift) & ((1 << ePCR_BATCH_RADIX_BITS) - 1)]++;
+    for (d=0; d < (1 << ePCR_BATCH_RADIX_BITS); d++) {
+      unsigned c = count[d];
+      count[d] = sum;
+      sum += c;
+    }
+    for (i=0; i<b.num; i++)
+      b.tmp[count[(b.words[i].h >> shift) & ((1 << ePCR_BATCH_RADIX_BITS) - 1)]++] = b.words[i];
+    batch_word_t *t = b.words; b.words = b.tmp; b.tmp = t;
+  }
+
+#ifdef EPCR_STATS
+  args->batches++;
+#endif
+  for (i=0; i<b.num; i=n) {
+    unsigned int h = b.words[i].h;
+    for (n=i+1; n<b.num && b.words[n].h == h; n++)
+      ;
+    for (STS *sts = search->sts_table[h]; sts; sts = sts->next) {
+#ifdef EPCR_STATS
+      args->sts_switches++;
+#endif
+      for (j=i; j<n; j++) {
+#ifdef EPCR_STATS
+	args->hash_hits++;
+#endif
+	if (b.words[j].pos >= sts->hash_offset) {
+	  size_t k = b.words[j].pos - sts->hash_offset;
+	  hits += Match(search, seq_data+k, seq_len-k, (int)k, sts, args);
+	}
+      }
+    }
+  }
+  b.num = 0;
+  return hits;
+}
+
+static int KERNEL(scan_batch) (const epcr_search_t *search, epcr_thread_args_t *args)
+{
+  size_t seq_len = args->length;
+  const char * seq_data = args->data;
+  const unsigned long long *occupied = search->occupied;
+  unsigned int wsize = search->wsize;
+  unsigned int mask = search->mask;
+  unsigned long first = args->num_hits;
+  batch_t batch;
+  int count = 0;
+
+  if (!MemAlloc(batch.words, ePCR_BATCH_SIZE * sizeof(batch_word_t))
+      || !MemAlloc(batch.tmp, ePCR_BATCH_SIZE * sizeof(batch_word_t))) {
+    fprintf (stderr, "Out of memory in the batch engine\n");
+    exit(1);
+  }
+  batch.num = 0;
+
+  if (seq_data && seq_len > args->scan_begin + wsize)
+    {
+      unsigned int h;
+      const char *p = seq_data + args->scan_begin;
+      int i, N;
+      size_t pos;
+
+      for(i=N=0, h=0; (unsigned)i<wsize; i++)
+	roll_hash(h, N, *p++, mask, wsize);
+
+      for (pos=args->scan_begin; (size_t)(p-seq_data)<seq_len && pos<args->scan_end; ++pos)
+	{
+	  if (N == 0)
+	    {
+	      if (occupied[h >> 6] & (1ULL << (h & 63))) {
+		batch.words[batch.num].h = h;
+		batch.words[batch.num].pos = (unsigned int) pos;
+		if (++batch.num == ePCR_BATCH_SIZE)
+		  count += verify_batch(search, args, batch);
+	      }
+#ifdef EPCR_STATS
+	      args->comparisons++;
+#endif
+	    }
+	  roll_hash(h, N, *p++, mask, wsize);
+	}
+      if (batch.num)
+	count += verify_batch(search, args, batch);
+    }
+
+  MemDealloc(batch.words);
+  MemDealloc(batch.tmp);
+
+  PCRmachine::SortHits(args, first);
+  return count;
+}
+
+
+/* The ac engine (E=ac, N=0 only)
+ *
+ * With N=0 a hit needs the whole left primer to match exactly, so
+ * instead of looking up every word in the hash table and comparing
+ * the primers of every STS in the bucket, one pass of the Aho-Corasick
+ * automaton built by PCRmachine::BuildAutomaton finds every
+ * occurrence of every left primer directly, at one table lookup per
+ * base however many STS's there are.  Only the right primer is then
+ * verified (MatchRight()).  An ambiguous base restarts the automaton.
+ * The few STS's left out of the automaton (see BuildAutomaton) are
+ * looked for by a second, hash based pass over just those.
+ *
+ * The hash scan never tries a primer whose word starts at or after
+ * seq_len - wsize, so neither does this engine.  The hits end up in
+ * the scan's order via PCRmachine::SortHits().
+ */
+static int KERNEL(scan_ac) (const epcr_search_t *search, epcr_thread_args_t *args)
+{
+  size_t seq_len = args->length;
+  const char * seq_data = args->data;
+  const epcr_automaton_t *ac = search->ac;
+  unsigned int wsize = search->wsize;
+  unsigned int mask = search->mask;
+  unsigned long first = args->num_hits;
+  int count = 0;
+
+  if (seq_data && seq_len > args->scan_begin + wsize)
+    {
+      size_t i, begin = args->scan_begin, limit = seq_len - wsize, end = seq_len;
+      unsigned state = 0;
+
+      // A primer with its word in the range starts in the overlap
+      // before it at the earliest and ends within overlap bases after it
+      if (limit > args->scan_end)
+	limit = args->scan_end;
+      if (end > limit + search->overlap)
+	end = limit + search->overlap;
+      for (i=0; i<end; i++)
+	{
+	  int c = _scode[seq_data[i]];
+	  if (c == AMBIG) {
+	    state = 0;
+	    continue;
+	  }
+	  state = ac->states[state].next[c];
+#ifdef EPCR_STATS
+	  args->comparisons++;
+#endif
+	  unsigned s = ac->states[state].out ? state : ac->states[state].dict;
+	  for (; s; s = ac->states[s].dict)
+	    for (const STS *sts = ac->states[s].out; sts; sts = sts->next_ac) {
+	      size_t k = i + 1 - sts->p1_len;
+#ifdef EPCR_STATS
+	      args->hash_hits++;
+#endif
+	      if (k + sts->hash_offset >= begin && k + sts->hash_offset < limit)
+		count += MatchRight(search, seq_data+k, seq_len-k, (int)k, sts, args);
+	    }
+	}
+
+      if (ac->num_residual)
+	{
+	  unsigned int h;
+	  const char *p = seq_data + begin;
+	  int N;
+	  size_t pos;
+
+	  for(i=N=0, h=0; i<wsize; i++)
+	    roll_hash(h, N, *p++, mask, wsize);
+	  for (pos=begin; (size_t)(p-seq_data)<seq_len && pos<args->scan_end; ++pos)
+	    {
+	      if (N == 0)
+		for (const STS *sts = ac->residual[h]; sts; sts = sts->next_ac)
+		  if (pos >= sts->hash_offset) {
+		    size_t k = pos - sts->hash_offset;
+		    count += Match(search, seq_data+k, seq_len-k, (int)k, sts, args);
+		  }
+	      roll_hash(h, N, *p++, mask, wsize);
+	    }
+	}
+    }
+
+  PCRmachine::SortHits(args, first);
+  return count;
+}
+
+
+// Compute a hash value for the specified primer.  Note that the hash
+// value may not contain ambiguous bases (e.g. 'N').  If there is not
+// a valid hash value at the end of the primer (i.e. the last wsize
+// bases include an ambig), then the next earlier hash value is tried,
+// until the beginning of the primer is reached.  If no valid hash
+// value is found anywhere in the primer, -1 is returned.  Otherwise,
+// the offset to the hash value is returned.
+
+static int KERNEL(hash) (const char *primer, int primer_len, unsigned wsize, unsigned &hash_value)
+{
+  unsigned int h;
+  int i, j;
+  const char *p;
+  int offset = primer_len - wsize;
+
+  do {
+    p = primer + offset;
+    h = 0;
+    // If i ever equals wsize, we have found a good hash value.
+    for (i=0; (unsigned)i<wsize; ++i)
+      {
+	if ((j=_scode[*p++]) == AMBIG)
+	  {
+	    // Bad hash value means we have to jump back to the next
+	    // possible hash value (we "add" one because of the offset
+	    // decrement at the end of the while loop ....)
+	    offset -= (wsize - i - 1);
+	    break;
+	  }
+	h <<= 2;
+	h |= (unsigned int) j;
+      }  // endfor
+
+    offset--;
+  } while ( (offset >= 0) && ((unsigned)i<wsize) );
+
+  if ((unsigned)i < wsize) {
+    hash_value = 0x666;  // HEX value ;-)
+    return -1;
+  } else {
+    hash_value = h;
+    offset++; // bump it because we auto-decremented
+    return offset;
+  }
+}
+
+
+#if defined(__SSSE3__)
+
+// Shuffle masks that squeeze byte i out of a 16-byte vector
+static const unsigned char squeeze_one[16][16] = {
+#define SQ(i) { (0<i)?0:1, (1<i)?1:2, (2<i)?2:3, (3<i)?3:4, (4<i)?4:5, (5<i)?5:6, (6<i)?6:7, (7<i)?7:8, \
+                (8<i)?8:9, (9<i)?9:10, (10<i)?10:11, (11<i)?11:12, (12<i)?12:13, (13<i)?13:14, (14<i)?14:15, 0x80 }
+  SQ(0), SQ(1), SQ(2), SQ(3), SQ(4), SQ(5), SQ(6), SQ(7),
+  SQ(8), SQ(9), SQ(10), SQ(11), SQ(12), SQ(13), SQ(14), SQ(15)
+#undef SQ
+};
+
+// Fast path for the common FASTA content: upper or lower case A, C, G,
+// T and N with at most one newline per 16 bytes.  Anything else (a
+// '\r', an IUPAC code, a '>' or the terminating '\0') makes us return
+// so the caller can handle the next 16 bytes one character at a time.
+// The loads are 16-byte aligned, so they never cross into an unmapped
+// page even when they run past the terminating '\0'.
+static inline char *parse_blocks (char *dst, const char **src)
+{
+  const char *s = *src;
+  const __m128i lower_lo = _mm_set1_epi8('a'-1), lower_hi = _mm_set1_epi8('z'+1);
+  const __m128i case_bit = _mm_set1_epi8(0x20);
+  const __m128i a = _mm_set1_epi8('A'), c = _mm_set1_epi8('C'), g = _mm_set1_epi8('G');
+  const __m128i t = _mm_set1_epi8('T'), n = _mm_set1_epi8('N'), nl = _mm_set1_epi8('\n');
+
+  while (1) {
+    __m128i v = _mm_load_si128((const __m128i *)s);
+    __m128i is_lower = _mm_and_si128(_mm_cmpgt_epi8(v, lower_lo), _mm_cmpgt_epi8(lower_hi, v));
+    __m128i u = _mm_sub_epi8(v, _mm_and_si128(is_lower, case_bit));
+    __m128i ok = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(u, a), _mm_cmpeq_epi8(u, c)),
+			      _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(u, g), _mm_cmpeq_epi8(u, t)),
+					   _mm_cmpeq_epi8(u, n)));
+    unsigned ok_bits = (unsigned)_mm_movemask_epi8(ok);
+
+    if (ok_bits == 0xFFFF) {
+      _mm_storeu_si128((__m128i *)dst, u);
+      dst += 16;
+    } else {
+      unsigned nl_bits = (unsigned)_mm_movemask_epi8(_mm_cmpeq_epi8(v, nl));
+      if ((ok_bits | nl_bits) != 0xFFFF || (nl_bits & (nl_bits-1)) != 0)
+	break;
+      // exactly one newline: squeeze it out.  dst never runs ahead of
+      // s, so the 16-byte store only covers bytes already loaded.
+      int at = __builtin_ctz(nl_bits);
+      u = _mm_shuffle_epi8(u, _mm_loadu_si128((const __m128i *)squeeze_one[at]));
+      _mm_storeu_si128((__m128i *)dst, u);
+      dst += 15;
+    }
+    s += 16;
+  }
+  *src = s;
+  return dst;
+}
+
+#endif // __SSSE3__
+
+
+static char *KERNEL(parse) (char *dst, const char **src, const unsigned char *charmap)
+{
+  const char *p = *src;
+  char chr;
+
+#if defined(__SSSE3__)
+  // The block copier knows nothing about charmap, so only use it when
+  // charmap agrees with it (true for both the nucleotide and the amino
+  // acid alphabets).
+  int fast = charmap['\n'] == 0;
+  for (const char *q = "ACGTN"; *q && fast; q++)
+    fast = charmap[(unsigned char)*q] == *q && charmap[(unsigned char)(*q|0x20)] == *q;
+
+  if (fast) {
+    while (1) {
+      // Align p for the block copier, then let it run until it bails
+      // out; finish that block one character at a time and retry.
+      const char *stop = (const char *)(((size_t)p + 15) & ~(size_t)15);
+      if (stop == p)
+	dst = parse_blocks(dst, &p), stop = p + 16;
+      while (p < stop) {
+	if ((chr = *p) == '\0' || chr == '>')
+	  goto Exit;
+	p++;
+	if ((chr=charmap[(unsigned char)chr]))
+	  *dst++ = chr;
+      }
+    }
+  }
+#endif
+
+  while ((chr = *p) != '\0' && chr != '>') {
+    p++;
+    if ((chr=charmap[(unsigned char)chr]))
+      *dst++ = chr;
+  }
+
+#if defined(__SSSE3__)
+ Exit:
+#endif
+  *src = p;
+  return dst;
+}
+
+
+static int KERNEL(match) (const epcr_search_t *search, epcr_thread_args_t *args, size_t k, const STS *sts)
+{
+  return Match(search, args->data+k, args->length-k, (int)k, sts, args);
+}
+
+
+static int KERNEL(primer_cmp) (const epcr_search_t *search, const char *seq, const STS *sts, int primer)
+{
+  return primer_cmp(search, seq, sts, primer);
+}
+
+
+extern const epcr_kernels_t KERNEL(ePCR_kernels) = {
+  KERNEL_STRING(EPCR_ISA),
+  EPCR_ISA_LEVEL,
+  KERNEL(scan),
+  KERNEL(scan_join),
+  KERNEL(scan_batch),
+  KERNEL(scan_ac),
+  KERNEL(match),
+  KERNEL(hash),
+  KERNEL(parse),
+  KERNEL(primer_cmp)
+};
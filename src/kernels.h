@@ -0,0 +1,75 @@
+#ifndef __kernels_h__
+#define __kernels_h__
+
+#include "stsmatch.h"
+
+/*
+ * The hot loops of me-PCR (sequence scan and rolling hash, primer
+ * hashing, FASTA parsing and primer comparison) live in kernels.cpp.
+ * The makefile compiles that file once per instruction set level, and
+ * cpu.cpp picks the best variant the CPU supports at startup (or the
+ * one forced with C=name on the command line).
+ */
+
+#define ePCR_ISA_GENERIC 0
+#define ePCR_ISA_SSE42   1   // SSE4.2 + POPCNT
+#define ePCR_ISA_AVX2    2   // AVX2 + BMI1/BMI2 + POPCNT
+#define ePCR_ISA_AVX512  3   // AVX-512 F/BW/VL + AVX2 + BMI2
+#define ePCR_ISA_COUNT   4
+
+typedef struct {
+  const char *name;
+  int isa;
+
+  // Scan args->data for hash hits and verify them (ProcessSeqThread)
+  int (*scan) (const epcr_search_t *search, epcr_thread_args_t *args);
+
+  // The same for the join engine (ePCR_ENGINE_JOIN)
+  int (*scan_join) (const epcr_search_t *search, epcr_thread_args_t *args);
+
+  // The same for the batch engine (ePCR_ENGINE_BATCH)
+  int (*scan_batch) (const epcr_search_t *search, epcr_thread_args_t *args);
+
+  // The same for the ac engine (ePCR_ENGINE_AC, N=0 only)
+  int (*scan_ac) (const epcr_search_t *search, epcr_thread_args_t *args);
+
+  // Verify sts with its left primer at args->data + k, recording the
+  // hits (Match(); used by the fm engine)
+  int (*match) (const epcr_search_t *search, epcr_thread_args_t *args, size_t k, const STS *sts);
+
+  // Hash value of a primer (see PCRmachine::HashValue)
+  int (*hash) (const char *primer, int primer_len, unsigned wsize, unsigned &hash_value);
+
+  // Copy characters from *src to dst through charmap, dropping those
+  // that map to 0, until a '\0' or '>' is reached.  *src is left at the
+  // terminating character; the new end of dst is returned.
+  char *(*parse) (char *dst, const char **src, const unsigned char *charmap);
+
+  // Compare primer PRIMER1 or PRIMER2 of sts with the sequence at seq
+  // (0 = match, -1 = no match)
+  int (*primer_cmp) (const epcr_search_t *search, const char *seq, const STS *sts, int primer);
+} epcr_kernels_t;
+
+// Lookup tables owned by stsmatch.cpp
+extern char _scode[128];
+extern unsigned char _IUPAC_bits[256];
+extern char _IUPAC_letters[16][32];
+
+extern const epcr_kernels_t ePCR_kernels_generic;
+#ifdef EPCR_MULTI_ISA
+extern const epcr_kernels_t ePCR_kernels_sse42;
+extern const epcr_kernels_t ePCR_kernels_avx2;
+extern const epcr_kernels_t ePCR_kernels_avx512;
+#endif
+
+// Default kernel variant (auto = best supported by this CPU)
+#define ePCR_CPU_DEFAULT "auto"
+
+extern const char *ePCR_cpu;
+
+int ePCR_CpuSupports (int isa);
+const epcr_kernels_t *ePCR_SelectKernels (const char *name);
+const epcr_kernels_t *ePCR_GetKernels (void);
+void ePCR_ListKernels (FILE *f);
+
+#endif
@@ -18,6 +18,9 @@
 
 #include "stsmatch.h"
 #include "fasta-io.h"
+#include "kernels.h"
+#include "fmindex.h"
+#include "numa.h"
 
 #ifdef __MWERKS__
 #include <string.h>
@@ -34,6 +37,12 @@
 // parent directory.
 const char *release_version = "1.0.6";
 
+// Called by FastaFile::ReadWindows() as the sequence file is parsed
+static void QueueWindow (void *ctx, const char *label, const char *data, size_t len, int complete)
+{
+	((PCRmachine *) ctx)->QueueSeqWindow(label, data, len, complete);
+}
+
 static int Usage(void)
 {
 	fprintf(stderr,"\nme-PCR: Multithreaded Electronic PCR\n");
@@ -48,7 +57,7 @@ static int Usage(void)
 	fprintf(stderr,"\tX=##     Number of 3' bases which must match (both primers) (default %d)\n",
 		ePCR_THREE_PRIME_MATCH_DEFAULT);
 	fprintf(stderr,"\tW=##     Word size (default %d)\n",ePCR_WDSIZE_DEFAULT);
-	fprintf(stderr,"\tT=##     Number of threads (default 1)\n");
+	fprintf(stderr,"\tT=##     Number of threads (default %d; 0 = one per CPU we may use)\n",ePCR_THREADS_DEFAULT);
 	fprintf(stderr,"\tO=file   Output file name (default %s)\n",ePCR_OUTFILE_DEFAULT);
 	fprintf(stderr,"\tQ=##     Quiet flag\n");
 	fprintf(stderr,"\t            0 = verbose progress messages\n");
@@ -59,6 +68,21 @@ static int Usage(void)
 	fprintf(stderr,"\tI=#      IUPAC flag\n");
 	fprintf(stderr,"\t            0 = do not honor IUPAC ambiguity symbols in STS's (default)\n");
 	fprintf(stderr,"\t            1 = honor IUPAC ambiguity symbols in STS's\n");
+	fprintf(stderr,"\tC=name   CPU kernel variant (default %s): ", ePCR_CPU_DEFAULT);
+	ePCR_ListKernels(stderr);
+	fprintf(stderr,"\tE=name   Search engine (default %s):", ePCR_engine_names[ePCR_ENGINE_DEFAULT]);
+	for (int i=0; ePCR_engine_names[i]; i++)
+		fprintf(stderr," %s", ePCR_engine_names[i]);
+	fprintf(stderr,"\n");
+	fprintf(stderr,"\tF=file   FM index of seqfile for E=fm (default seqfile%s)\n", ePCR_FM_INDEX_SUFFIX);
+	fprintf(stderr,"\tD=name   Share the search out between threads by (default %s):", ePCR_shard_names[ePCR_SHARD_DEFAULT]);
+	for (int i=0; ePCR_shard_names[i]; i++)
+		fprintf(stderr," %s", ePCR_shard_names[i]);
+	fprintf(stderr,"\n");
+	fprintf(stderr,"\tU=name   Place the STS index on NUMA nodes (default %s):", ePCR_numa_names[ePCR_NUMA_DEFAULT]);
+	for (int i=0; ePCR_numa_names[i]; i++)
+		fprintf(stderr," %s", ePCR_numa_names[i]);
+	fprintf(stderr,"\n");
 
 
 #ifdef __MWERKS__
@@ -83,6 +107,10 @@ int main (int argc, char **argv)
 	int mmatch = ePCR_MMATCH_DEFAULT;
 	int wdsize = ePCR_WDSIZE_DEFAULT;
 	unsigned three_prime_match = ePCR_THREE_PRIME_MATCH_DEFAULT;
+	int engine = ePCR_ENGINE_DEFAULT;
+	int shard = ePCR_SHARD_DEFAULT;
+	int numa = ePCR_NUMA_DEFAULT;
+	const char *indexfile = NULL;
 
 #ifdef __MWERKS__
     argc = ccommand(&argv);
@@ -117,6 +145,28 @@ int main (int argc, char **argv)
 				ePCR_iupac_mode = atoi(argv[i]+2);
 			else if (argv[i][0] == 'X')
 				three_prime_match = atoi(argv[i]+2);
+			else if (argv[i][0] == 'C')
+				ePCR_cpu = argv[i]+2;
+			else if (argv[i][0] == 'F')
+				indexfile = argv[i]+2;
+			else if (argv[i][0] == 'E') {
+				if ((engine = ePCR_EngineByName(argv[i]+2)) < 0) {
+					fprintf (stderr, "Unknown search engine (E=) '%s'\n", argv[i]+2);
+					return Usage();
+				}
+			}
+			else if (argv[i][0] == 'D') {
+				if ((shard = ePCR_ShardByName(argv[i]+2)) < 0) {
+					fprintf (stderr, "Unknown shard mode (D=) '%s'\n", argv[i]+2);
+					return Usage();
+				}
+			}
+			else if (argv[i][0] == 'U') {
+				if ((numa = ePCR_NumaByName(argv[i]+2)) < 0) {
+					fprintf (stderr, "Unknown NUMA mode (U=) '%s'\n", argv[i]+2);
+					return Usage();
+				}
+			}
 		}
 		else if (argv[i][0] == '-')    // -option
 		{
@@ -143,7 +193,7 @@ int main (int argc, char **argv)
 	  return Usage();
 	}
 
-	if (ePCR_quiet > 1 || ePCR_priority > 30 || ePCR_threads == 0 || ePCR_iupac_mode > 1) {
+	if (ePCR_quiet > 1 || ePCR_priority > 30 || ePCR_threads < 0 || ePCR_iupac_mode > 1) {
 	  fprintf (stderr, "One or more of the Q=, I=, P=, or T= arguments is invalid\n");
 	  return Usage();
 	}
@@ -159,6 +209,9 @@ int main (int argc, char **argv)
 	
 	if (stsfile==NULL || seqfile==NULL)
 		return Usage();
+
+	if (!ePCR_SelectKernels(ePCR_cpu))
+		return 1;
 	
 	///// Read STS primers database
 
@@ -168,6 +221,9 @@ int main (int argc, char **argv)
 	e_PCR->SetMargin(margin);
 	e_PCR->SetMismatch(mmatch);
 	e_PCR->SetThreePrimeMatch(three_prime_match);
+	e_PCR->SetEngine(engine);
+	e_PCR->SetShard(shard);
+	e_PCR->SetNuma(numa);
 
 	if (!ePCR_quiet) {
 		fprintf (stderr, "me-PCR parameters:\n");
@@ -181,40 +237,62 @@ int main (int argc, char **argv)
 						ePCR_priority, ePCR_PRIORITY_MIN, ePCR_PRIORITY_MAX);
 #endif
 		fprintf (stderr, "\toutfile=%s\n", ePCR_outfile);
-		fprintf (stderr, "\tthreads=%d\n", ePCR_threads);
+		fprintf (stderr, "\tthreads=%d (0=automatic)\n", ePCR_threads);
 		fprintf (stderr, "\tmax STS line length=%d\n", ePCR_STS_line_length);
+		fprintf (stderr, "\tkernels=%s\n", ePCR_GetKernels()->name);
+		fprintf (stderr, "\tengine=%s\n", ePCR_engine_names[e_PCR->GetEngine()]);
+		fprintf (stderr, "\tshard=%s\n", ePCR_shard_names[e_PCR->GetShard()]);
+		fprintf (stderr, "\tnuma=%s\n", ePCR_numa_names[e_PCR->GetNuma()]);
 		fprintf (stderr, "\n");
 	}
 
-	
-	if (ePCR_FileSize(seqfile) < e_PCR->MIN_FILESIZE_FOR_THREADING) {
-	  if (!ePCR_quiet)
-	    fprintf (stderr, "Notice: only one thread will be used because file is so small.\n");
-	  ePCR_threads = 1;
-	}
-
 	if (!e_PCR->ReadStsFile(stsfile))
 		return 1;
 
+	if (ePCR_threads == ePCR_THREADS_AUTO) {
+	  // As many threads as the CPUs we may use, but no more than the
+	  // file has work for
+	  double most = e_PCR->EstimateWork(ePCR_FileSize(seqfile)) / ePCR_MIN_TASK_WORK;
+	  ePCR_threads = ePCR_NumCPUs();
+	  if (most < ePCR_threads)
+	    ePCR_threads = (most < 1) ? 1 : (int) most;
+	  if (!ePCR_quiet)
+	    fprintf (stderr, "Notice: using %d threads\n", ePCR_threads);
+	}
+
 	///// Process sequence database (FASTA format)
 
-	FastaFile fafile(SEQTYPE_NT);
+	if (engine == ePCR_ENGINE_FM) {
+	  // Search the FM index of the sequence file instead of the file itself
+	  char *defaultfile = NULL;
+	  if (indexfile == NULL) {
+	    if (!MemAlloc(defaultfile, strlen(seqfile) + strlen(ePCR_FM_INDEX_SUFFIX) + 1)) {
+	      fprintf (stderr, "out of memory\n");
+	      return 1;
+	    }
+	    sprintf (defaultfile, "%s%s", seqfile, ePCR_FM_INDEX_SUFFIX);
+	    indexfile = defaultfile;
+	  }
+	  epcr_fm_index_t *fm = ePCR_FmOpen(seqfile, indexfile);
+	  e_PCR->ProcessIndex(fm);
+	  ePCR_FmClose(fm);
+	  MemDealloc(defaultfile);
+	}
+	else {
+	  FastaFile fafile(SEQTYPE_NT);
 
-	if (!fafile.Open(seqfile,"rb"))
-		return 1;
+	  if (!fafile.Open(seqfile,"rb"))
+	    return 1;
 
-	if (!ePCR_quiet)
-	  fprintf (stderr, "m_margin=%d, max_pcr=%d\n", e_PCR->GetMargin(), e_PCR->max_pcr_size);
+	  if (!ePCR_quiet)
+	    fprintf (stderr, "m_margin=%d, max_pcr=%d\n", e_PCR->GetMargin(), e_PCR->max_pcr_size);
 
-	// Fetch a vector of fasta seqs from fasta file
-	fafile.Read();
-	
-	for (unsigned i=0; i<fafile.NumSeqs(); i++) {
-	  FastaSeq **seqs = fafile.Seqs();
-	  e_PCR->ProcessSeq(seqs[i]->Label(),seqs[i]->Sequence(), seqs[i]->Length());
-	}
+	  // Search the sequences while the rest of the file is read
+	  fafile.ReadWindows(QueueWindow, e_PCR);
+	  e_PCR->FlushSeqs();
 
-	fafile.Close();
+	  fafile.Close();
+	}
 
 #ifndef __MWERKS__
 	/* The poor Mac SIOUX user _requires_ an indication that me-PCR has finished */
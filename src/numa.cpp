@@ -0,0 +1,221 @@
+///////////////////////////////////////////////////////////////////
+//
+//		Multithreaded Electronic PCR (me-PCR) program
+//
+//		NUMA nodes and memory placement (see numa.h).
+//
+///////////////////////////////////////////////////////////////////
+
+#include "numa.h"
+
+#ifdef __linux__
+#include <sched.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#endif
+
+#ifdef DMALLOC
+#include "dmalloc.h"
+#endif
+
+#ifndef MPOL_PREFERRED
+#define MPOL_PREFERRED 1
+#endif
+#ifndef MPOL_INTERLEAVE
+#define MPOL_INTERLEAVE 3
+#endif
+
+// Most nodes and CPUs we look at
+#define ePCR_NUMA_MAX_NODES 1024
+#define ePCR_NUMA_MAX_CPUS 4096
+
+const char *ePCR_numa_names[] = { "none", "replicate", "interleave", NULL };
+
+// NUMA mode number for a U= name, or -1
+int ePCR_NumaByName (const char *name)
+{
+  int i;
+
+  for (i=0; ePCR_numa_names[i]; i++)
+    if (strcasecmp(name, ePCR_numa_names[i]) == 0)
+      return i;
+  return -1;
+}
+
+
+#ifdef __linux__
+
+// Read a list like "0-3,8-11" from fname into set (set[i] = 1 for
+// each i in it, up to max); FALSE if there is no such file
+static int ReadList (const char *fname, char *set, int max)
+{
+  FILE *f = fopen (fname, "r");
+  int from, to;
+
+  if (f == NULL)
+    return FALSE;
+  memset (set, 0, max);
+  while (fscanf (f, "%d", &from) == 1) {
+    to = from;
+    int c = fgetc (f);
+    if (c == '-') {
+      if (fscanf (f, "%d", &to) != 1)
+	break;
+      c = fgetc (f);
+    }
+    for (; from <= to && from < max; from++)
+      if (from >= 0)
+	set[from] = 1;
+    if (c != ',')
+      break;
+  }
+  fclose (f);
+  return TRUE;
+}
+
+#endif
+
+
+// The nodes, and the CPUs of each that we may run on.  A node none of
+// whose CPUs we may use is left out.  A simulated node may get none of
+// them, if there are fewer CPUs than nodes.
+
+epcr_numa_t *ePCR_NumaTopology (void)
+{
+  epcr_numa_t *numa;
+  int *node_of;           // node (system number) of each CPU we may use, or -1
+  int num_cpus = 0, c, n, k;
+  const char *sim = getenv ("EPCR_NUMA_NODES");
+
+  if (!MemAlloc (numa, sizeof(epcr_numa_t))
+      || !MemAlloc (node_of, ePCR_NUMA_MAX_CPUS*sizeof(int))
+      || !MemAlloc (numa->ids, ePCR_NUMA_MAX_NODES*sizeof(int))) {
+    fprintf (stderr, "out of memory\n");
+    exit (1);
+  }
+  numa->num_nodes = 1;
+  numa->ids[0] = 0;
+  numa->simulated = (sim != NULL && atoi (sim) > 0);
+  for (c=0; c<ePCR_NUMA_MAX_CPUS; c++)
+    node_of[c] = -1;
+
+#ifdef __linux__
+  cpu_set_t mask;
+  char set[ePCR_NUMA_MAX_CPUS], nodes[ePCR_NUMA_MAX_NODES], fname[100];
+
+  if (sched_getaffinity (0, sizeof(mask), &mask) != 0)
+    CPU_ZERO (&mask);
+  for (c=0; c<ePCR_NUMA_MAX_CPUS && c<CPU_SETSIZE; c++)
+    if (CPU_ISSET (c, &mask))
+      node_of[c] = 0, num_cpus++;
+
+  if (numa->simulated) {
+    // Deal the CPUs out to the nodes in turn
+    numa->num_nodes = atoi (sim);
+    if (numa->num_nodes > ePCR_NUMA_MAX_NODES)
+      numa->num_nodes = ePCR_NUMA_MAX_NODES;
+    for (n=0; n<numa->num_nodes; n++)
+      numa->ids[n] = n;
+    for (c=0, k=0; c<ePCR_NUMA_MAX_CPUS; c++)
+      if (node_of[c] >= 0)
+	node_of[c] = k++ % numa->num_nodes;
+  } else if (ReadList ("/sys/devices/system/node/online", nodes, ePCR_NUMA_MAX_NODES)) {
+    int found = 0;
+    for (n=0; n<ePCR_NUMA_MAX_NODES; n++) {
+      sprintf (fname, "/sys/devices/system/node/node%d/cpulist", n);
+      if (!nodes[n] || !ReadList (fname, set, ePCR_NUMA_MAX_CPUS))
+	continue;
+      int used = 0;
+      for (c=0; c<ePCR_NUMA_MAX_CPUS; c++)
+	if (set[c] && node_of[c] >= 0)
+	  node_of[c] = n, used = 1;
+      if (used)
+	numa->ids[found++] = n;
+    }
+    if (found > 0)
+      numa->num_nodes = found;
+  }
+#endif
+
+  if (!MemAlloc (numa->first, (numa->num_nodes+1)*sizeof(int))
+      || !MemAlloc (numa->cpus, (num_cpus+1)*sizeof(int))) {
+    fprintf (stderr, "out of memory\n");
+    exit (1);
+  }
+
+  // Gather the CPUs by node
+  for (n=0, k=0; n<numa->num_nodes; n++) {
+    numa->first[n] = k;
+    for (c=0; c<ePCR_NUMA_MAX_CPUS; c++)
+      if (node_of[c] >= 0 && (node_of[c] == numa->ids[n] || numa->num_nodes == 1))
+	numa->cpus[k++] = c;
+  }
+  numa->first[numa->num_nodes] = k;
+
+  MemDealloc (node_of);
+  return numa;
+}
+
+
+// Memory for size bytes on node (an index into numa->ids), or
+// interleaved over all the nodes if node is -1.  The pages are only
+// bound to a node if it is a real one; the memory is zeroed.
+
+void *ePCR_NumaAlloc (const epcr_numa_t *numa, int node, size_t size)
+{
+  void *mem;
+
+#ifdef __linux__
+  mem = mmap (NULL, size, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+  if (mem == MAP_FAILED) {
+    fprintf (stderr, "Out of memory in ePCR_NumaAlloc (%lu bytes)\n", (unsigned long) size);
+    exit (1);
+  }
+#ifdef SYS_mbind
+  if (!numa->simulated && numa->num_nodes > 1) {
+    unsigned long nodemask[ePCR_NUMA_MAX_NODES / (8*sizeof(unsigned long))];
+    int n, bits = 8*sizeof(unsigned long);
+
+    memset (nodemask, 0, sizeof(nodemask));
+    for (n=0; n<numa->num_nodes; n++)
+      if (node < 0 || n == node)
+	nodemask[numa->ids[n] / bits] |= 1UL << (numa->ids[n] % bits);
+    // Placement is only a hint: carry on where the kernel refuses it
+    if (syscall (SYS_mbind, mem, size, node < 0 ? MPOL_INTERLEAVE : MPOL_PREFERRED,
+		 nodemask, (unsigned long) ePCR_NUMA_MAX_NODES, 0) != 0 && !ePCR_quiet)
+      fprintf (stderr, "Notice: couldn't place memory on NUMA node %d\n", node < 0 ? -1 : numa->ids[node]);
+  }
+#endif
+#else
+  if (!MemAlloc (mem, size)) {
+    fprintf (stderr, "Out of memory in ePCR_NumaAlloc (%lu bytes)\n", (unsigned long) size);
+    exit (1);
+  }
+  memset (mem, 0, size);
+#endif
+  return mem;
+}
+
+
+void ePCR_NumaDealloc (void *mem, size_t size)
+{
+  if (mem == NULL)
+    return;
+#ifdef __linux__
+  munmap (mem, size);
+#else
+  MemDealloc (mem);
+#endif
+}
+
+
+void ePCR_NumaFree (epcr_numa_t *numa)
+{
+  if (numa == NULL)
+    return;
+  MemDealloc (numa->ids);
+  MemDealloc (numa->first);
+  MemDealloc (numa->cpus);
+  MemDealloc (numa);
+}
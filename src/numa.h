@@ -0,0 +1,38 @@
+#ifndef __numa_h__
+#define __numa_h__
+
+#include "util.h"
+
+/*
+ * NUMA placement of the search index (U= on the command line, see
+ * PCRmachine::BuildReplicas).  ePCR_NumaTopology() finds the nodes and
+ * the CPUs of each that this process may use; ePCR_NumaAlloc() gets
+ * memory on one node, or interleaved over all of them.  Setting the
+ * environment variable EPCR_NUMA_NODES to n simulates n nodes (the
+ * CPUs are dealt out to them in turn and memory is not bound), so the
+ * NUMA code paths can be tried on a machine with one node.
+ */
+
+#define ePCR_NUMA_NONE 0        // leave the index where it was built
+#define ePCR_NUMA_REPLICATE 1   // a copy of the index on each node, for its threads
+#define ePCR_NUMA_INTERLEAVE 2  // one copy, its pages spread over the nodes
+#define ePCR_NUMA_COUNT 3
+#define ePCR_NUMA_DEFAULT ePCR_NUMA_NONE
+
+extern const char *ePCR_numa_names[];
+int ePCR_NumaByName (const char *name);
+
+typedef struct epcr_numa {
+  int num_nodes;
+  int simulated;          // from EPCR_NUMA_NODES
+  int *ids;               // the system's number for each node
+  int *cpus;              // the CPUs of node n are cpus[first[n]] to cpus[first[n+1]-1]
+  int *first;
+} epcr_numa_t;
+
+epcr_numa_t *ePCR_NumaTopology (void);
+void ePCR_NumaFree (epcr_numa_t *numa);
+void *ePCR_NumaAlloc (const epcr_numa_t *numa, int node, size_t size);
+void ePCR_NumaDealloc (void *mem, size_t size);
+
+#endif
@@ -0,0 +1,338 @@
+///////////////////////////////////////////////////////////////////
+//
+//		Multithreaded Electronic PCR (me-PCR) program
+//
+//		Persistent pool of search threads (see pool.h).
+//
+///////////////////////////////////////////////////////////////////
+
+#define _REENTRANT
+#include <pthread.h>
+#ifdef __linux__
+#include <sched.h>
+#endif
+#include <time.h>
+#include <sys/time.h>
+
+#include "pool.h"
+
+#ifdef DMALLOC
+#include "dmalloc.h"
+#endif
+
+typedef struct {
+  epcr_task_fn_t fn;
+  void *ctx;
+  unsigned long task;
+} epcr_task_t;
+
+// Each worker has a deque of tasks, a ring of max_tasks entries.
+// ePCR_PoolSubmit() deals the tasks out to the workers in turn and a
+// worker takes its own from the front, so the tasks are started
+// roughly in the order they were submitted.  A worker whose deque
+// runs dry steals the back half of another's, so a worker held up by
+// a slow stretch of sequence doesn't hold up the tasks dealt to it
+// after that.
+typedef struct {
+  pthread_mutex_t lock;
+  epcr_task_t *ring;
+  unsigned long first;          // index in ring of the front of the deque
+  unsigned long count;
+  epcr_task_t *loot;            // room for what this worker steals
+
+  // Statistics for ePCR_PoolReport()
+  double busy;                  // seconds spent in tasks
+  double cpu;                   // CPU seconds spent in tasks
+  unsigned long tasks;
+  unsigned long stolen;
+} epcr_worker_t;
+
+struct epcr_pool {
+  pthread_mutex_t lock;
+  pthread_cond_t work;          // signalled when a task is submitted
+  pthread_cond_t done;          // signalled when the last task submitted finishes
+  pthread_t *threads;
+  epcr_worker_t *workers;
+  int num_workers;
+  unsigned long max_tasks;
+  int shutdown;
+  int next_worker;              // the one to deal the next task to
+
+  // Protected by lock
+  long available;               // tasks waiting in the deques
+  unsigned long unfinished;     // tasks submitted and not finished
+};
+
+typedef struct {
+  epcr_pool_t *pool;
+  int worker;
+} epcr_worker_arg_t;
+
+
+static double WallClock (void)
+{
+  struct timeval tv;
+  gettimeofday (&tv, NULL);
+  return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+static double ThreadClock (void)
+{
+#ifdef CLOCK_THREAD_CPUTIME_ID
+  struct timespec ts;
+  if (clock_gettime (CLOCK_THREAD_CPUTIME_ID, &ts) == 0)
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+#endif
+  return 0.0;
+}
+
+
+// Take the next task for worker w, from its own deque or stolen from
+// another; FALSE when there are none.
+static int NextTask (epcr_pool_t *pool, int w, epcr_task_t &task)
+{
+  epcr_worker_t *self = pool->workers + w;
+  unsigned long cap = pool->max_tasks, i, n;
+  int v;
+
+  pthread_mutex_lock (&self->lock);
+  if (self->count > 0) {
+    task = self->ring[self->first];
+    self->first = (self->first + 1) % cap;
+    self->count--;
+    pthread_mutex_unlock (&self->lock);
+    return TRUE;
+  }
+  pthread_mutex_unlock (&self->lock);
+
+  for (v=1; v<pool->num_workers; v++) {
+    epcr_worker_t *victim = pool->workers + (w+v) % pool->num_workers;
+
+    pthread_mutex_lock (&victim->lock);
+    n = (victim->count + 1) / 2;
+    for (i=0; i<n; i++)
+      self->loot[i] = victim->ring[(victim->first + victim->count - n + i) % cap];
+    victim->count -= n;
+    pthread_mutex_unlock (&victim->lock);
+    if (n == 0)
+      continue;
+
+    // Run the first and put the rest in front of anything dealt to
+    // this worker meanwhile
+    task = self->loot[0];
+    pthread_mutex_lock (&self->lock);
+    for (i=n-1; i>0; i--) {
+      self->first = (self->first + cap - 1) % cap;
+      self->ring[self->first] = self->loot[i];
+      self->count++;
+    }
+    self->stolen += n;
+    pthread_mutex_unlock (&self->lock);
+    return TRUE;
+  }
+  return FALSE;
+}
+
+
+static void *PoolWorker (void *arg)
+{
+  epcr_pool_t *pool = ((epcr_worker_arg_t *) arg)->pool;
+  int worker = ((epcr_worker_arg_t *) arg)->worker;
+  epcr_worker_t *self = pool->workers + worker;
+  epcr_task_t task;
+
+  MemDealloc (arg);
+
+  for (;;) {
+    pthread_mutex_lock (&pool->lock);
+    while (!pool->shutdown && pool->available <= 0)
+      pthread_cond_wait (&pool->work, &pool->lock);
+    if (pool->shutdown)
+      break;
+    pthread_mutex_unlock (&pool->lock);
+
+    while (NextTask (pool, worker, task)) {
+      pthread_mutex_lock (&pool->lock);
+      pool->available--;
+      pthread_mutex_unlock (&pool->lock);
+
+      double wall = WallClock(), cpu = ThreadClock();
+      task.fn (task.ctx, task.task, worker);
+      self->busy += WallClock() - wall;
+      self->cpu += ThreadClock() - cpu;
+      self->tasks++;
+
+      pthread_mutex_lock (&pool->lock);
+      if (--pool->unfinished == 0)
+	pthread_cond_broadcast (&pool->done);
+      pthread_mutex_unlock (&pool->lock);
+    }
+  }
+  pthread_mutex_unlock (&pool->lock);
+  return NULL;
+}
+
+
+epcr_pool_t *ePCR_PoolCreate (int num_workers, unsigned long max_tasks)
+{
+  epcr_pool_t *pool;
+  int i, rv;
+
+  if (!MemAlloc (pool, sizeof(epcr_pool_t))
+      || !MemAlloc (pool->threads, num_workers*sizeof(pthread_t))
+      || !MemAlloc (pool->workers, num_workers*sizeof(epcr_worker_t))) {
+    fprintf (stderr, "out of memory\n");
+    exit (1);
+  }
+  pthread_mutex_init (&pool->lock, NULL);
+  pthread_cond_init (&pool->work, NULL);
+  pthread_cond_init (&pool->done, NULL);
+  pool->num_workers = num_workers;
+  pool->max_tasks = max_tasks;
+  pool->shutdown = 0;
+  pool->next_worker = 0;
+  pool->available = 0;
+  pool->unfinished = 0;
+  memset (pool->workers, 0, num_workers*sizeof(epcr_worker_t));
+
+  for (i=0; i<num_workers; i++) {
+    epcr_worker_t *w = pool->workers + i;
+    if (!MemAlloc (w->ring, max_tasks*sizeof(epcr_task_t))
+	|| !MemAlloc (w->loot, max_tasks*sizeof(epcr_task_t))) {
+      fprintf (stderr, "out of memory\n");
+      exit (1);
+    }
+    pthread_mutex_init (&w->lock, NULL);
+  }
+  for (i=0; i<num_workers; i++) {
+    epcr_worker_arg_t *arg;
+    if (!MemAlloc (arg, sizeof(epcr_worker_arg_t))) {
+      fprintf (stderr, "out of memory\n");
+      exit (1);
+    }
+    arg->pool = pool;
+    arg->worker = i;
+    rv = pthread_create (pool->threads+i, NULL, PoolWorker, arg);
+    if (rv != 0) {
+      fprintf (stderr, "error starting thread %d of %d. Code=%d\n", i+1, num_workers, rv);
+      exit (1);
+    }
+  }
+  return pool;
+}
+
+
+void ePCR_PoolSubmit (epcr_pool_t *pool, epcr_task_fn_t fn, void *ctx, unsigned long task)
+{
+  if (pool == NULL) {
+    fn (ctx, task, 0);
+    return;
+  }
+
+  epcr_worker_t *w = pool->workers + pool->next_worker;
+  pool->next_worker = (pool->next_worker + 1) % pool->num_workers;
+
+  pthread_mutex_lock (&w->lock);
+  if (w->count == pool->max_tasks) {
+    fprintf (stderr, "Error: more than %lu search tasks submitted at once\n", pool->max_tasks);
+    exit (1);
+  }
+  epcr_task_t *t = w->ring + (w->first + w->count) % pool->max_tasks;
+  t->fn = fn;
+  t->ctx = ctx;
+  t->task = task;
+  w->count++;
+  pthread_mutex_unlock (&w->lock);
+
+  pthread_mutex_lock (&pool->lock);
+  pool->available++;
+  pool->unfinished++;
+  pthread_cond_signal (&pool->work);
+  pthread_mutex_unlock (&pool->lock);
+}
+
+
+void ePCR_PoolWait (epcr_pool_t *pool)
+{
+  if (pool == NULL)
+    return;
+  pthread_mutex_lock (&pool->lock);
+  while (pool->unfinished > 0)
+    pthread_cond_wait (&pool->done, &pool->lock);
+  pthread_mutex_unlock (&pool->lock);
+}
+
+
+int ePCR_PoolSize (const epcr_pool_t *pool)
+{
+  return pool ? pool->num_workers : 1;
+}
+
+
+// Print how the work was shared out between the threads
+
+void ePCR_PoolReport (const epcr_pool_t *pool, FILE *f)
+{
+  double total = 0, most = 0;
+  int i;
+
+  if (pool == NULL)
+    return;
+  for (i=0; i<pool->num_workers; i++) {
+    const epcr_worker_t *w = pool->workers + i;
+    fprintf (f, "thread %d: %lu tasks (%lu stolen), busy %.3f s, cpu %.3f s\n",
+	     i, w->tasks, w->stolen, w->busy, w->cpu);
+    total += w->cpu;
+    if (w->cpu > most)
+      most = w->cpu;
+  }
+  if (total > 0)
+    fprintf (f, "busiest thread: %.2f times the mean cpu time\n", most * pool->num_workers / total);
+}
+
+
+// Keep a worker to the given CPUs; FALSE if that isn't possible here
+
+int ePCR_PoolPin (epcr_pool_t *pool, int worker, const int *cpus, int num_cpus)
+{
+#if defined(__linux__) && defined(CPU_SET)
+  cpu_set_t mask;
+  int i;
+
+  if (pool == NULL || num_cpus <= 0)
+    return FALSE;
+  CPU_ZERO (&mask);
+  for (i=0; i<num_cpus; i++)
+    if (cpus[i] < CPU_SETSIZE)
+      CPU_SET (cpus[i], &mask);
+  return pthread_setaffinity_np (pool->threads[worker], sizeof(mask), &mask) == 0;
+#else
+  return FALSE;
+#endif
+}
+
+
+void ePCR_PoolDestroy (epcr_pool_t *pool)
+{
+  int i;
+
+  if (pool == NULL)
+    return;
+  pthread_mutex_lock (&pool->lock);
+  pool->shutdown = 1;
+  pthread_cond_broadcast (&pool->work);
+  pthread_mutex_unlock (&pool->lock);
+  for (i=0; i<pool->num_workers; i++)
+    pthread_join (pool->threads[i], NULL);
+  for (i=0; i<pool->num_workers; i++) {
+    pthread_mutex_destroy (&pool->workers[i].lock);
+    MemDealloc (pool->workers[i].ring);
+    MemDealloc (pool->workers[i].loot);
+  }
+  pthread_cond_destroy (&pool->done);
+  pthread_cond_destroy (&pool->work);
+  pthread_mutex_destroy (&pool->lock);
+  MemDealloc (pool->threads);
+  MemDealloc (pool->workers);
+  MemDealloc (pool);
+}
@@ -0,0 +1,29 @@
+#ifndef __pool_h__
+#define __pool_h__
+
+#include "util.h"
+
+/*
+ * A pool of search threads created once and reused for every
+ * sequence (see PCRmachine::QueueSeq).  ePCR_PoolSubmit() hands a
+ * task to the workers, which call fn(ctx, task, worker) for it, and
+ * returns at once; ePCR_PoolWait() returns when all the tasks
+ * submitted have finished.  No more than max_tasks may be waiting to
+ * start at a time.  The tasks are dealt out to the workers in turn and
+ * idle workers steal from busy ones (see pool.cpp).  With a NULL pool
+ * a task runs in the calling thread when it is submitted.
+ */
+
+typedef void (*epcr_task_fn_t) (void *ctx, unsigned long task, int worker);
+
+typedef struct epcr_pool epcr_pool_t;
+
+epcr_pool_t *ePCR_PoolCreate (int num_workers, unsigned long max_tasks);
+void ePCR_PoolSubmit (epcr_pool_t *pool, epcr_task_fn_t fn, void *ctx, unsigned long task);
+void ePCR_PoolWait (epcr_pool_t *pool);
+int ePCR_PoolSize (const epcr_pool_t *pool);
+void ePCR_PoolReport (const epcr_pool_t *pool, FILE *f);
+int ePCR_PoolPin (epcr_pool_t *pool, int worker, const int *cpus, int num_cpus);
+void ePCR_PoolDestroy (epcr_pool_t *pool);
+
+#endif
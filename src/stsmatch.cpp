@@ -42,6 +42,9 @@
 #include <errno.h>
 #include <time.h>
 #include <ctype.h>
+#include <limits.h>
+#include <typeinfo>
+#include <new>
 
 #ifndef __MWERKS__
 #define _REENTRANT    /* do I need this? */
@@ -52,33 +55,64 @@
 #include <string.h>
 #endif
 
-#include "stsmatch.h"
+#include "kernels.h"
+#include "fmindex.h"
+#include "pool.h"
+#include "numa.h"
 
 #ifdef DMALLOC
 #include "dmalloc.h"
 #endif
 
 
-#define AMBIG 100
-
 unsigned ePCR_STS_line_length = ePCR_MAX_STS_LINE_LENGTH_DEFAULT;
 
 unsigned ePCR_default_pcr_size = ePCR_DEFAULT_PCR_SIZE_DEFAULT;
 
 unsigned ePCR_iupac_mode = ePCR_IUPAC_MODE_DEFAULT;
 
+const char *ePCR_engine_names[] = { "hash", "join", "batch", "ac", "fm", NULL };
+
+// Engine number for an E= name, or -1
+int ePCR_EngineByName (const char *name)
+{
+  int i;
+
+  for (i=0; ePCR_engine_names[i]; i++)
+    if (strcasecmp(name, ePCR_engine_names[i]) == 0)
+      return i;
+  return -1;
+}
+
+const char *ePCR_shard_names[] = { "auto", "seq", "sts", NULL };
+
+// Shard mode number for a D= name, or -1
+int ePCR_ShardByName (const char *name)
+{
+  int i;
+
+  for (i=0; ePCR_shard_names[i]; i++)
+    if (strcasecmp(name, ePCR_shard_names[i]) == 0)
+      return i;
+  return -1;
+}
+
 char _scode[128];
 int  _scode_inited;
 char _compl[128];
 int  _compl_inited;
 
 // Our match algorithm for STS's containing ambiguous base characters
-// will use the following lookup table.  The size (64K) seems extreme, but I am 
-// going for speed over memory.  A reasonable alternative would be 
-// to use 2^12 or 2^10 slots and do bit shifting and masking to create 
-// the indices.  The table needs to be initialized by _init_IUPAC_match_matrix().
-unsigned char *_IUPAC_match_matrix;
-unsigned int _IUPAC_match_matrix_inited;
+// works on sets of nucleotides: _IUPAC_bits maps each symbol to the set
+// it stands for (A=1, C=2, G=4, T=U=8, so R=A|G, N=A|C|G|T, ...).  A
+// sequence base matches a primer base if its set is contained in the
+// primer's.  Anything that is not an IUPAC symbol maps to 0x10, which
+// no primer set contains, so it matches nothing; primers keep only the
+// low 4 bits (see STS::STS), so a non-IUPAC primer base matches nothing
+// either.  _IUPAC_letters lists, for each primer set, the symbols that
+// match it.  The tables need to be initialized by init_IUPAC_bits().
+unsigned char _IUPAC_bits[256];
+char _IUPAC_letters[16][32];
 struct {
   char base;
   char *matches;
@@ -112,45 +146,53 @@ inline char *reverse (const char *from, int len, char *to);
 #define MY_TOUPPER(c) ((c)&~32)
 
 
-// Initialize the IUPAC mapping matrix used by seqmcmp_ambig()
-
-void init_IUPAC_match_matrix (void) {
-  int i = 0;
+// Initialize the IUPAC nucleotide sets used by seqmcmp_ambig() from
+// _IUPAC_mapping
 
-  if (ePCR_iupac_mode) {
+void init_IUPAC_bits (void) {
+  int i;
 
-    if (!MemAlloc (_IUPAC_match_matrix, 65536)) {
-      fprintf (stderr, "out of memory\n");
-      exit (1);
-    }
-    memset (_IUPAC_match_matrix, '\0', 65536);
-
-    while (_IUPAC_mapping[i].base != '\0') {
-      char *s = _IUPAC_mapping[i].matches;
-      while (*s) {
-	// STS value (.base) is in lower byte ...
-	_IUPAC_match_matrix[(((unsigned short)(*s)) << 8) + (unsigned char)_IUPAC_mapping[i].base] = 1;
-	s++;
+  memset (_IUPAC_bits, 0x10, sizeof(_IUPAC_bits));
+  for (i=0; _IUPAC_mapping[i].base != '\0'; i++) {
+    unsigned char bits = 0;
+    for (char *s = _IUPAC_mapping[i].matches; *s; s++) {
+      switch (*s) {
+      case 'A': bits |= 1; break;
+      case 'C': bits |= 2; break;
+      case 'G': bits |= 4; break;
+      case 'T': case 'U': bits |= 8; break;
       }
-      i++;
     }
-    _IUPAC_match_matrix_inited = 1;
+    _IUPAC_bits[(unsigned char)_IUPAC_mapping[i].base] = bits;
   }
-}
 
-void free_IUPAC_match_matrix (void) {
-  if (_IUPAC_match_matrix_inited && _IUPAC_match_matrix) {
-    MemDealloc (_IUPAC_match_matrix);
+  for (i=0; i<16; i++) {
+    char *s = _IUPAC_letters[i];
+    for (int c='A'; c<='Z'; c++)
+      if ((_IUPAC_bits[c] & ~i) == 0)
+	*s++ = c;
+    *s = '\0';
   }
 }
 
 
 
+// Nucleotide sets for the bases of an ambiguous primer, for
+// seqmcmp_ambig()
+static unsigned char *new_IUPAC_set (const char *primer, int len)
+{
+  unsigned char *set = new unsigned char[len];
+  int i;
+
+  for (i=0; i<len; i++)
+    set[i] = _IUPAC_bits[(unsigned char)primer[i]] & 0x0F;
+  return set;
+}
+
+
 // Create an array for quick determination of ambiguity
 unsigned char _ambig[256];
 int ambig_inited;
-#define PRIMER1 1
-#define PRIMER2 2
 void init_ambig (void) {
   _ambig['B'] = 1;	/* B = C, G or T */
   _ambig['D'] = 1;	/* D = A, G or T */
@@ -200,23 +242,55 @@ PCRmachine::PCRmachine ()
 {
 	init_scode();
 	init_compl();
-	init_IUPAC_match_matrix();
+	init_IUPAC_bits();
 	init_ambig();
 	m_file = NULL;
+	max_pcr_size = 0;
+	m_sts_table = NULL;
+	m_sts_table_right = NULL;
+	m_occupied = NULL;
+	m_ac = NULL;
+	m_shard = ePCR_SHARD_DEFAULT;
+	m_num_shards = 1;
+	m_shard_bounds = NULL;
+	m_index_bytes = 0;
+	m_numa = ePCR_NUMA_DEFAULT;
+	m_numa_nodes = NULL;
+	m_replicas = NULL;
+	m_replica_memory = NULL;
+	m_replica_size = 0;
+	m_num_replicas = 0;
+	m_worker_replica = NULL;
+	m_last_global_sts = NULL;
+	m_pool = NULL;
+	m_args = NULL;
+	m_num_args = 0;
+	m_next_task = m_written = 0;
+	pthread_mutex_init (&m_lock, NULL);
+	pthread_cond_init (&m_task_done, NULL);
+	m_format_hits = FALSE;
+	m_fname = NULL;
+	m_thread_files = NULL;
+	m_num_thread_files = 0;
+	m_seq_hits = 0;
+	m_task_length = ePCR_TASK_WORK;
+	m_min_task_length = ePCR_MIN_TASK_WORK;
+	m_window_data = NULL;
+	m_window_begin = 0;
+#ifdef EPCR_STATS
+	memset (&m_seq_stats, 0, sizeof(m_seq_stats));
+#endif
 	SetWordSize(ePCR_WDSIZE_DEFAULT);
 	SetMargin(ePCR_MARGIN_DEFAULT);
 	SetMismatch(ePCR_MMATCH_DEFAULT);
 	SetThreePrimeMatch(ePCR_THREE_PRIME_MATCH_DEFAULT);
-	max_pcr_size = 0;
-	m_sts_table = NULL;
-	m_last_global_sts = NULL;
+	SetEngine(ePCR_ENGINE_DEFAULT);
 }
 
 
 PCRmachine::~PCRmachine ()
 {
   STS *s = m_last_global_sts;
-  free_IUPAC_match_matrix();
   if (!ePCR_quiet) fprintf (stderr, "Deleting STS's\n");
   while (s) {
     STS *next_s = s->global_prev;
@@ -224,6 +298,30 @@ PCRmachine::~PCRmachine ()
     s = next_s;
   }
   delete [] m_sts_table;
+  delete [] m_sts_table_right;
+  delete [] m_occupied;
+  FreeAutomaton();
+  MemDealloc(m_shard_bounds);
+  FreeReplicas();
+  ePCR_NumaFree(m_numa_nodes);
+#ifndef EPCR_STATS
+  if (!ePCR_quiet)
+#endif
+    ePCR_PoolReport(m_pool, stderr);
+  ePCR_PoolDestroy(m_pool);
+  for (int i=0; i<m_num_args; i++) {
+    MemDealloc(m_args[i].hits);
+    MemDealloc(m_args[i].text);
+  }
+  MemDealloc(m_args);
+  // The first thread formats with m_file
+  for (int i=1; i<m_num_thread_files; i++)
+    if (m_thread_files[i])
+      fclose(m_thread_files[i]);
+  MemDealloc(m_thread_files);
+  MemDealloc(m_fname);
+  pthread_cond_destroy (&m_task_done);
+  pthread_mutex_destroy (&m_lock);
   if (m_file) {
     if (!ePCR_quiet) fprintf (stderr, "Closing STS file\n");
     fclose(m_file);
@@ -276,6 +374,13 @@ void PCRmachine::SetThreePrimeMatch (unsigned three_prime_match)
 
     m_three_prime_match = three_prime_match;
 
+  // The STS's already read have their X= masks precomputed
+  for (STS *sts = m_last_global_sts; sts; sts = sts->global_prev)
+    SetPrimerMasks(sts);
+  // and the join table depends on X=
+  delete [] m_sts_table_right;
+  m_sts_table_right = NULL;
+
   if (!ePCR_quiet) fprintf (stderr, "m_three_prime_match=%u\n", m_three_prime_match);
 
 }
@@ -315,6 +420,9 @@ void PCRmachine::SetMismatch (int mmatch)
 	     (int) ePCR_MMATCH_MAX);
   } else {
     m_mmatch = mmatch;
+    // The join table depends on N= (see BuildJoinTable); rebuild it on next use
+    delete [] m_sts_table_right;
+    m_sts_table_right = NULL;
   }
 
 }
@@ -326,12 +434,67 @@ int PCRmachine::GetMismatch (void)
 }
 
 
+void PCRmachine::SetEngine (int engine)
+{
+  if (engine < 0 || engine >= ePCR_ENGINE_COUNT) {
+    fprintf (stderr, "Error: engine (E=) number %d must be between 0 and %d, inclusive",
+	     engine, ePCR_ENGINE_COUNT-1);
+  } else {
+    m_engine = engine;
+  }
+}
+
+
+int PCRmachine::GetEngine (void)
+{
+	return m_engine;
+}
 
 
-int PCRmachine::ReportHit (char *line, const char *seq_label, int pos1, int pos2, const STS *sts, long offset)
+void PCRmachine::SetShard (int shard)
+{
+  if (shard < 0 || shard >= ePCR_SHARD_COUNT) {
+    fprintf (stderr, "Error: shard mode (D=) number %d must be between 0 and %d, inclusive",
+	     shard, ePCR_SHARD_COUNT-1);
+  } else {
+    m_shard = shard;
+  }
+}
+
+
+int PCRmachine::GetShard (void)
+{
+	return m_shard;
+}
+
+
+void PCRmachine::SetNuma (int numa)
+{
+  if (numa < 0 || numa >= ePCR_NUMA_COUNT) {
+    fprintf (stderr, "Error: NUMA mode (U=) number %d must be between 0 and %d, inclusive",
+	     numa, ePCR_NUMA_COUNT-1);
+  } else {
+    m_numa = numa;
+  }
+}
+
+
+int PCRmachine::GetNuma (void)
 {
-	fseek(m_file, offset, SEEK_SET);
-	if (fgets(line, ePCR_STS_line_length+2, m_file))
+	return m_numa;
+}
+
+
+
+
+// Read the line of the STS file at offset into line, cut off after
+// the STS ID, and set tail to the part of the line after the PCR size
+// (NULL if there is none).  FALSE if the line can't be read.
+
+static int ReadStsLine (FILE *f, char *line, long offset, char *&tail)
+{
+	fseek(f, offset, SEEK_SET);
+	if (fgets(line, ePCR_STS_line_length+2, f))
 	{
 	        // Chomp off the end-of-line
     	        char *eol = line + strlen(line) - 1;
@@ -347,77 +510,133 @@ int PCRmachine::ReportHit (char *line, const char *seq_label, int pos1, int pos2
 		p = strchr(p+1,'\t');
 		p = strchr(p+1,'\t');
 		p = strchr(p+1,'\t');   // p points to a tab or is NULL
-		
-		ePCR_printf( "%s\t%d..%d\t%s%s\t(%c)\n",seq_label,pos1+1,pos2+1,line,(p?p:""),sts->direct);
-	}
-	else
-	{
-		fprintf(stderr, "Error reading file (from offset %ld)\n",offset);
+		tail = p;
+		return TRUE;
 	}
+	fprintf(stderr, "Error reading file (from offset %ld)\n",offset);
+	return FALSE;
+}
+
+
+int PCRmachine::ReportHit (char *line, const char *seq_label, int pos1, int pos2, const STS *sts, long offset)
+{
+	char *p;
+
+	if (ReadStsLine(m_file, line, offset, p))
+		ePCR_printf( "%s\t%d..%d\t%s%s\t(%c)\n",seq_label,pos1+1,pos2+1,line,(p?p:""),sts->direct);
 	return TRUE;
 }
 
 
+// Format a task's hits as ReportHit() prints them, into a->text.  This
+// runs in the search thread, which reads the STS file through its own
+// handle.
+
+void PCRmachine::FormatHits (epcr_thread_args_t *a, int worker)
+{
+  unsigned long hit;
+  char *line, *p;
+
+  a->text_len = 0;
+  a->formatted = TRUE;
+  if (a->num_hits == 0)
+    return;
+
+  FILE *&f = m_thread_files[worker];
+  if (f == NULL && (f = fopen(m_fname, "rb")) == NULL) {
+    fprintf(stderr,"Error: unable to open STS file: [%s]\n",m_fname);
+    exit(1);
+  }
+  if (!MemAlloc (line, ePCR_STS_line_length+2)) {
+    fprintf (stderr, "out of memory in FormatHits()\n");
+    exit (1);
+  }
+
+  for (hit=0; hit<a->num_hits; hit++) {
+    const epcr_hit_t *h = a->hits + hit;
+    if (!ReadStsLine(f, line, h->sts->m_offset, p))
+      continue;
+    size_t room = strlen(a->seq_label) + strlen(line) + (p ? strlen(p) : 0) + 32;
+    if (a->text_len + room > a->text_allocated) {
+      size_t allocated = 2*a->text_allocated > a->text_len + room ? 2*a->text_allocated : a->text_len + room;
+      if (!MemResize (a->text, allocated)) {
+	fprintf (stderr, "out of memory in FormatHits()\n");
+	exit (1);
+      }
+      a->text_allocated = allocated;
+    }
+    int len = sprintf (a->text + a->text_len, "%s\t%d..%d\t%s%s\t(%c)\n", a->seq_label,
+		       (int)(a->offset + h->pos1 + 1), (int)(a->offset + h->pos2 + 1),
+		       line, (p?p:""), h->sts->direct);
+    if (len > ePCR_OUTPUT_LINE_MAX) {
+      fprintf (stderr, "ERROR: Output line exceed limit of %d characters\n", ePCR_OUTPUT_LINE_MAX);
+      exit(1);
+    }
+    a->text_len += len;
+  }
+  MemDealloc (line);
+}
+
+
 
 
 
 
 /*
- * We have 1-ePCR_threads worth of results.  Each thread's results are
- * in order of the offset at which the hit occurred.  There may be
- * overlap between adjacent threads' result sets.  We eliminate
- * overlap by throwing out any hits for a thread which occur within
- * the first overlap bytes, UNLESS the thread is the first one (has a
- * base offset of 0).  
+ * We have the results of num_tasks tasks, in order.  Each task's
+ * results are in order of the offset at which the hit occurred, and
+ * no two tasks try the same hash word, so there are no duplicates.
+ * The search threads may have formatted them already (FormatHits()).
+ * The totals are printed after the last task of each sequence.
  * 2002-11-20 KPM: added support for EPCR_STATS and also non-quiet 
  * reporting of total hits, which is needed for the threaded version.
 */
-void PCRmachine::ReportHits (const char *seq_label, epcr_thread_args_t *a, int num_threads)
+void PCRmachine::ReportHits (epcr_thread_args_t *a, int num_tasks)
 {
   int i;
   unsigned long hit;
   char *line;
-  unsigned long hits = 0;
-#ifdef EPCR_STATS
-  unsigned long hash_hits = 0, hash_looks = 0, string_comparisons = 0;
-#endif
 
   if (!MemAlloc (line, ePCR_STS_line_length+2)) {
     fprintf (stderr, "out of memory in ReportHits() (pretty tragic ;-)\n");
     exit (1);
   }
 
-  for (i=0; i<num_threads; i++) {
+  for (i=0; i<num_tasks; i++) {
 #ifdef EPCR_STATS
-    hash_hits += a[i].hash_hits;
-    hash_looks += a[i].comparisons;
-    string_comparisons += a[i].string_comparisons;
+    m_seq_stats.hash_hits += a[i].hash_hits;
+    m_seq_stats.comparisons += a[i].comparisons;
+    m_seq_stats.string_comparisons += a[i].string_comparisons;
+    m_seq_stats.sts_switches += a[i].sts_switches;
+    m_seq_stats.batches += a[i].batches;
 #endif
-    for (hit=0; hit<a[i].num_hits; hit++) {
-      if (a[i].offset != 0 && (size_t) a[i].hits[hit].pos2 < m_overlap) {
-	// This _should be_ a redundant hit!
-	if (!ePCR_quiet) {
-	  fprintf (stderr, "skipping redundant hit at offset %lu\n", (unsigned long) (a[i].offset + a[i].hits[hit].pos1));
-	}
-      } else {
-	// Report a non-redundant hit
-	ReportHit (line, seq_label, a[i].offset + a[i].hits[hit].pos1, a[i].offset + a[i].hits[hit].pos2, a[i].hits[hit].sts, a[i].hits[hit].sts->m_offset);
-	hits++;
+    if (a[i].formatted) {
+      ePCR_write (a[i].text, a[i].text_len);
+      m_seq_hits += a[i].num_hits;
+    } else
+      for (hit=0; hit<a[i].num_hits; hit++) {
+	ReportHit (line, a[i].seq_label, a[i].offset + a[i].hits[hit].pos1, a[i].offset + a[i].hits[hit].pos2, a[i].hits[hit].sts, a[i].hits[hit].sts->m_offset);
+	m_seq_hits++;
       }
-    }
-  }
+    if (!a[i].last)
+      continue;
 
-  MemDealloc (line);
 #ifdef EPCR_STATS
-  fprintf (stderr, "hash looks = %lu, hash hits = %lu, string comparisons = %lu\n", hash_looks, hash_hits, string_comparisons); 
-  if (ePCR_quiet) {
-    // if STATS is on, the user probably wants this number!
-    fprintf (stderr, "Total hits = %lu\n", hits);
-  }
+    fprintf (stderr, "hash looks = %lu, hash hits = %lu, string comparisons = %lu\n", m_seq_stats.comparisons, m_seq_stats.hash_hits, m_seq_stats.string_comparisons); 
+    fprintf (stderr, "STS switches = %lu, verification batches = %lu\n", m_seq_stats.sts_switches, m_seq_stats.batches);
+    if (ePCR_quiet) {
+      // if STATS is on, the user probably wants this number!
+      fprintf (stderr, "Total hits = %lu\n", m_seq_hits);
+    }
+    memset (&m_seq_stats, 0, sizeof(m_seq_stats));
 #endif
-  if (!ePCR_quiet) {
-    fprintf (stderr, "Total hits = %lu\n", hits);
+    if (!ePCR_quiet) {
+      fprintf (stderr, "Total hits = %lu\n", m_seq_hits);
+    }
+    m_seq_hits = 0;
   }
+
+  MemDealloc (line);
 }
 
 
@@ -444,178 +663,766 @@ void PCRmachine::RecordHit (epcr_thread_args_t *a, int pos1, int pos2, const STS
 }
 
 
-void *PCRmachine::ThreadProc (void *args)
+// Engines that don't find hits in the order of the hash engine record
+// them in any order and then call SortHits() to restore it: by the
+// position of the left primer's hash, then by position in the hash
+// table bucket, then in Match()'s order for the right primer (expected
+// size first, then -1, +1, -2, +2, ...).  first is the index of the
+// first hit recorded by the engine in this chunk.
+
+typedef struct {
+  size_t seed;
+  unsigned chain_rank;
+  unsigned margin_rank;
+  epcr_hit_t hit;
+} epcr_sort_hit_t;
+
+static int CompareSortHits (const void *a, const void *b)
+{
+  const epcr_sort_hit_t *x = (const epcr_sort_hit_t *) a;
+  const epcr_sort_hit_t *y = (const epcr_sort_hit_t *) b;
+
+  if (x->seed != y->seed)
+    return x->seed < y->seed ? -1 : 1;
+  if (x->chain_rank != y->chain_rank)
+    return x->chain_rank < y->chain_rank ? -1 : 1;
+  if (x->margin_rank != y->margin_rank)
+    return x->margin_rank < y->margin_rank ? -1 : 1;
+  return 0;
+}
+
+void PCRmachine::SortHits (epcr_thread_args_t *a, unsigned long first)
 {
-  // Process sequence database (FASTA format)
-  PCRmachine *object_ptr = static_cast<PCRmachine *>(((epcr_thread_args_t *)args)->object_ptr);
+  unsigned long i, n = a->num_hits - first;
+  epcr_sort_hit_t *sorted;
 
+  if (n < 2)
+    return;
+
+  if (!MemAlloc (sorted, n*sizeof(epcr_sort_hit_t))) {
+    fprintf (stderr, "Out of memory in PCRmachine::SortHits\n");
+    exit(1);
+  }
+
+  for (i=0; i<n; i++) {
+    epcr_hit_t *h = &a->hits[first+i];
+    // Match() coerces the expected size near the end of the sequence
+    long exp_size = h->sts->pcr_size;
+    if (exp_size > (long) a->length - h->pos1)
+      exp_size = (long) a->length - h->pos1;
+    long d = h->pos2 - (h->pos1 + exp_size - 1);
+
+    sorted[i].seed = h->pos1 + h->sts->hash_offset;
+    sorted[i].chain_rank = h->sts->chain_rank;
+    sorted[i].margin_rank = (d == 0) ? 0 : (d < 0) ? (unsigned)(-2*d - 1) : (unsigned)(2*d);
+    sorted[i].hit = *h;
+  }
+
+  qsort (sorted, n, sizeof(epcr_sort_hit_t), CompareSortHits);
+
+  for (i=0; i<n; i++)
+    a->hits[first+i] = sorted[i].hit;
+  MemDealloc (sorted);
+}
+
+
+void PCRmachine::RunTask (void *ctx, unsigned long task, int worker)
+{
+  // Search one queued task (a task of ePCR_PoolRun())
+  PCRmachine *object_ptr = static_cast<PCRmachine *>(ctx);
+  epcr_thread_args_t *args = object_ptr->m_args + task;
+
+  args->id = worker;
+  args->search = object_ptr->m_replicas ? object_ptr->m_replicas + object_ptr->m_worker_replica[worker] : NULL;
   if (!ePCR_quiet) {
-    size_t offset = ((epcr_thread_args_t *)args)->offset;
-    size_t length = ((epcr_thread_args_t *)args)->length;
-    int id = ((epcr_thread_args_t *)args)->id;
-    fprintf (stderr, "Thread %d is about to start working at offset %d over %d bytes\n", id, (int)offset, (int)length);
+    fprintf (stderr, "Thread %d is about to start working on '%s' at offset %d over %d bytes\n", worker, args->seq_label, (int)args->offset, (int)args->length);
   }
   
-  object_ptr->ProcessSeqThread((epcr_thread_args_t *)args);
+  object_ptr->ProcessSeqThread(args);
+
+  // The last shard of a stretch to finish gathers the hits of them all
+  // into the first
+  int i, n = args->num_shards;
+  if (n > 1) {
+    epcr_thread_args_t *first = object_ptr->m_args + args->group % object_ptr->m_num_args;
+    pthread_mutex_lock (&object_ptr->m_lock);
+    int left = --first->shards_left;
+    pthread_mutex_unlock (&object_ptr->m_lock);
+    if (left > 0)
+      return;
+    object_ptr->MergeShards(first);
+    args = first;
+  }
 
-  return NULL;
-}
+  if (object_ptr->m_format_hits)
+    object_ptr->FormatHits(args, worker);
 
+  pthread_mutex_lock (&object_ptr->m_lock);
+  for (i=0; i<n; i++)
+    object_ptr->m_args[(args - object_ptr->m_args + i) % object_ptr->m_num_args].done = TRUE;
+  pthread_cond_signal (&object_ptr->m_task_done);
+  pthread_mutex_unlock (&object_ptr->m_lock);
+}
 
 
-// This routine divides up the task for the desired number of threads and
-// starts them rolling.  
+// Move the hits of the shards of a stretch of sequence to the first of
+// them and put them in the order of an unsharded search: a hash word
+// is in one shard only, so SortHits() restores it.
 
-int PCRmachine::ProcessSeq (const char *seq_label, const char *seq_data, size_t seq_len)
+void PCRmachine::MergeShards (epcr_thread_args_t *first)
 {
+  unsigned long total = 0;
   int i;
-  epcr_thread_args_t *arg_array;
-  pthread_t *threads;
-  int num_threads = ePCR_threads;  // the canonical case; may be reduced, though
 
+  for (i=0; i<first->num_shards; i++)
+    total += m_args[(first - m_args + i) % m_num_args].num_hits;
+  if (total > first->num_hits_allocated) {
+    if (!MemResize (first->hits, total * sizeof(epcr_hit_t))) {
+      fprintf (stderr, "Out of memory in PCRmachine::MergeShards\n");
+      exit (1);
+    }
+    first->num_hits_allocated = total;
+  }
+  for (i=1; i<first->num_shards; i++) {
+    epcr_thread_args_t *a = m_args + (first - m_args + i) % m_num_args;
+    memcpy (first->hits + first->num_hits, a->hits, a->num_hits * sizeof(epcr_hit_t));
+    first->num_hits += a->num_hits;
+    a->num_hits = 0;
+#ifdef EPCR_STATS
+    first->hash_hits += a->hash_hits;
+    first->comparisons += a->comparisons;
+    first->string_comparisons += a->string_comparisons;
+    a->hash_hits = a->comparisons = a->string_comparisons = 0;
+#endif
+  }
+  SortHits (first, 0);
+}
+
+
+
+// Build what the engine needs and fill in m_search for the kernels.
+
+void PCRmachine::PrepareSearch (void)
+{
   // This is the minimum required data m_overlap between each
   // thread chunk.
   m_overlap = max_pcr_size + m_margin - 1;
 
-  if (!ePCR_quiet)
-    fprintf (stderr, "Processing seq: '%s': m_overlap is %lu (from max_pcr_size of %lu and m_margin of %lu)\n", 
-	     seq_label,
-	     (unsigned long)m_overlap, 
-	     (unsigned long)max_pcr_size, 
-	     (unsigned long) m_margin);
-  
-  if ((num_threads > 1) && ((num_threads+1)*m_overlap > seq_len)) {
-
-    // This combination of threads, margin, max pcr size, and sequence
-    // length is not valid, because each thread wants a chance to find
-    // the largest possible STS in its allocated subchunk of the
-    // sequence.  So let's step down the number of threads until we
-    // find the minimum number that work.
-
-    do {
-      --num_threads;
-    } while ((num_threads > 1) && ((num_threads+1)*m_overlap > seq_len));
-
-    /*
-    if (max_pcr_size > 10000)
-      fprintf (stderr, "\tThe max pcr size looks suspiciously large.  You may want to edit your STS file.\n");
-    if (ePCR_threads > 20)
-      fprintf (stderr, "\tThe number of threads is quite large.  "
-	       "It is not useful to use many more threads than you have processors.  Try fewer threads.\n");
-    if (m_margin > 10000)
-      fprintf (stderr, "\tThe margin looks suspiciously large.  Try a lower value if possible.\n");
-    */
-
+  if (m_engine == ePCR_ENGINE_JOIN && m_sts_table_right == NULL)
+    BuildJoinTable();
+  if (m_engine == ePCR_ENGINE_BATCH && m_occupied == NULL)
+    BuildOccupancy();
+  if (m_engine == ePCR_ENGINE_AC) {
+    // The automaton finds exact left primers only
+    if (m_mmatch != 0) {
+      if (!ePCR_quiet)
+	fprintf (stderr, "ac engine: N=%d, searching with the hash engine\n", m_mmatch);
+    } else if (m_ac == NULL)
+      BuildAutomaton();
   }
 
-  size_t chunk_size = (size_t) ceil((seq_len - (num_threads+1)*m_overlap)/(double)num_threads) + 2*m_overlap;
+  m_search.sts_table = m_sts_table;
+  m_search.sts_table_right = m_sts_table_right;
+  m_search.occupied = m_occupied;
+  m_search.ac = m_mmatch == 0 ? m_ac : NULL;
+  m_search.wsize = m_wsize;
+  m_search.mask = m_mask;
+  m_search.mmatch = m_mmatch;
+  m_search.three_prime_match = m_three_prime_match;
+  m_search.overlap = m_overlap;
+}
 
-  if (m_overlap >= chunk_size && num_threads > 1) {
-    fprintf (stderr, "Error: m_overlap of %lu exceeds chunk size of %lu.  ",
-	     (unsigned long)m_overlap, (unsigned long)chunk_size);
-    fprintf (stderr, "Try fewer threads.  Also, "); 
-    fprintf (stderr, 
-	     "This could be cause by an excessively large STS (max pcr size from file is %d, or a large margin (currently %d)\n",
-	     (int) max_pcr_size, (int) m_margin);
-    exit(1);
+
+// Search one sequence now.  (me-PCR itself queues all the sequences
+// of the file with QueueSeq(), so the threads can share them out.)
+
+int PCRmachine::ProcessSeq (const char *seq_label, const char *seq_data, size_t seq_len)
+{
+  QueueSeq (seq_label, seq_data, seq_len);
+  return FlushSeqs();
+} // end ProcessSeq
+
+
+// Estimate the work of searching seq_len bases, in bases: at each
+// one the hash word is updated and the STS's in its bucket of the hash
+// table are tried, m_sts_count / 4^W of them on average.  (M and the
+// PCR sizes make a difference only where a left primer matches.)
+
+double PCRmachine::EstimateWork (size_t seq_len)
+{
+  return seq_len * (1.0 + m_sts_count / ldexp(1.0, 2*m_wsize));
+}
+
+
+// Set up the threads and the ring of tasks for a search (with no
+// tasks under way)
+
+void PCRmachine::StartTasks (void)
+{
+  int i, num;
+
+  if (ePCR_threads == ePCR_THREADS_AUTO)
+    ePCR_threads = ePCR_NumCPUs();
+  num = ePCR_TASKS_PER_THREAD * ePCR_threads;
+
+  PrepareSearch();
+
+  // Sizes of the tasks, from the work there is in a base
+  double per_base = EstimateWork(1);
+  m_task_length = (size_t) (ePCR_TASK_WORK / per_base);
+  m_min_task_length = (size_t) (ePCR_MIN_TASK_WORK / per_base);
+  if (m_min_task_length < m_overlap)
+    m_min_task_length = m_overlap;
+  if (m_min_task_length < 1)
+    m_min_task_length = 1;
+  if (m_task_length < m_min_task_length)
+    m_task_length = m_min_task_length;
+
+  ChooseShards();
+
+  // A class derived from this one may override ReportHit(), which then
+  // has to see every hit
+  m_format_hits = (typeid(*this) == typeid(PCRmachine));
+
+  int new_pool = (ePCR_threads != ePCR_PoolSize(m_pool) || m_args == NULL);
+  if (new_pool) {
+    ePCR_PoolDestroy(m_pool);
+    m_pool = (ePCR_threads > 1) ? ePCR_PoolCreate(ePCR_threads, num) : NULL;
+
+    for (i=0; i<m_num_args; i++) {
+      MemDealloc(m_args[i].hits);
+      MemDealloc(m_args[i].text);
+    }
+    for (i=1; i<m_num_thread_files; i++)
+      if (m_thread_files[i])
+	fclose(m_thread_files[i]);
+    if (!MemResize (m_args, num*sizeof(epcr_thread_args_t))
+	|| !MemResize (m_thread_files, ePCR_threads*sizeof(FILE *))) {
+      fprintf (stderr, "out of memory\n");
+      exit (1);
+    }
+    memset (m_args, '\0', num*sizeof(epcr_thread_args_t));
+    memset (m_thread_files, '\0', ePCR_threads*sizeof(FILE *));
+    m_thread_files[0] = m_file;
+    m_num_args = num;
+    m_num_thread_files = ePCR_threads;
   }
 
-  size_t offset = 0;
-  size_t length = chunk_size;
+  if (m_numa == ePCR_NUMA_NONE || m_pool == NULL)
+    FreeReplicas();
+  else if (new_pool || m_replicas == NULL
+	   || memcmp (&m_replicated, &m_search, sizeof(epcr_search_t)) != 0)
+    BuildReplicas();
+}
+
 
-  if (!MemAlloc (arg_array, num_threads*sizeof(epcr_thread_args_t))) {
+// Share the STS's out between the threads (m_num_shards > 1) if they
+// take more memory than the cache (with D=auto), cutting the hash
+// values into ranges with about as many STS's each.  Only the hash
+// engine's scan can leave out the STS's of other shards.
+
+void PCRmachine::ChooseShards (void)
+{
+  int num = 1;
+  unsigned long h, n;
+
+  if (ePCR_threads > 1
+      && (m_engine == ePCR_ENGINE_HASH || (m_engine == ePCR_ENGINE_AC && m_search.ac == NULL))) {
+    if (m_shard == ePCR_SHARD_STS)
+      num = ePCR_threads;
+    else if (m_shard == ePCR_SHARD_AUTO && m_index_bytes > ePCR_CacheSize())
+      num = ePCR_threads;
+  } else if (m_shard == ePCR_SHARD_STS && !ePCR_quiet)
+    fprintf (stderr, "Notice: D=sts needs the hash engine and more than one thread; searching by sequence\n");
+
+  if (num == m_num_shards && (num == 1 || m_shard_bounds))
+    return;
+
+  m_num_shards = num;
+  if (num == 1)
+    return;
+  if (!MemResize (m_shard_bounds, (num+1) * sizeof(unsigned long))) {
     fprintf (stderr, "out of memory\n");
     exit (1);
   }
-  memset (arg_array, '\0', sizeof(arg_array));
+  m_shard_bounds[0] = 0;
+  for (h=0, n=0, num=1; h<m_asize && num<m_num_shards; h++) {
+    for (STS *sts = m_sts_table[h]; sts; sts = sts->next)
+      n++;
+    while (num < m_num_shards && n >= m_sts_count * num / m_num_shards)
+      m_shard_bounds[num++] = h+1;
+  }
+  while (num <= m_num_shards)
+    m_shard_bounds[num++] = m_asize;
 
-  size_t last_offset = offset-1;
-  
-  if (!MemAlloc (threads, num_threads*sizeof(pthread_t))) {
+  if (!ePCR_quiet)
+    fprintf (stderr, "Searching %d shards of the STS's (%lu MB of them, %lu MB of cache)\n",
+	     m_num_shards, (unsigned long) (m_index_bytes >> 20), ePCR_CacheSize() >> 20);
+}
+
+
+// With U=replicate, give each NUMA node that runs search threads a
+// copy of the index in its own memory, and keep its threads to its
+// CPUs; with U=interleave, make one copy spread over all the nodes.
+// The index is only read during the search, so the copies need no
+// locking.  A thread that steals a task searches its own node's copy.
+
+void PCRmachine::BuildReplicas (void)
+{
+  int w, r, nodes, threads = ePCR_PoolSize(m_pool);
+  unsigned long strings = 0;
+
+  FreeReplicas();
+  if (m_numa_nodes == NULL)
+    m_numa_nodes = ePCR_NumaTopology();
+  nodes = m_numa_nodes->num_nodes;
+  if (nodes == 1 && !m_numa_nodes->simulated) {
+    if (!ePCR_quiet)
+      fprintf (stderr, "Notice: one NUMA node; the index is left where it is\n");
+    return;
+  }
+
+  // The size of a copy: automaton states first (they are aligned to
+  // a cache line), then the tables, the STS's and their primers
+  m_replica_size = 0;
+  if (m_search.ac)
+    m_replica_size += m_search.ac->num_states * sizeof(epcr_ac_state_t)
+      + sizeof(epcr_automaton_t) + m_asize * sizeof(STS *);
+  m_replica_size += m_asize * sizeof(STS *);
+  if (m_search.sts_table_right)
+    m_replica_size += m_asize * sizeof(STS *);
+  if (m_search.occupied)
+    m_replica_size += (m_asize + 63) / 64 * sizeof(unsigned long long);
+  m_replica_size += m_sts_count * sizeof(STS);
+  for (STS *s = m_last_global_sts; s; s = s->global_prev) {
+    strings += s->p1_len + s->p2_len + 2;
+    if (s->p1_iupac)
+      strings += s->p1_len;
+    if (s->p2_iupac)
+      strings += s->p2_len;
+  }
+  m_replica_size += strings;
+
+  m_num_replicas = (m_numa == ePCR_NUMA_REPLICATE) ? (nodes < threads ? nodes : threads) : 1;
+  if (!MemAlloc (m_replicas, m_num_replicas * sizeof(epcr_search_t))
+      || !MemAlloc (m_replica_memory, m_num_replicas * sizeof(void *))
+      || !MemAlloc (m_worker_replica, threads * sizeof(int))) {
     fprintf (stderr, "out of memory\n");
     exit (1);
   }
-  memset (threads, '\0', sizeof(threads));
+  for (r=0; r<m_num_replicas; r++)
+    CopyIndex (r, m_numa == ePCR_NUMA_REPLICATE ? r : -1);
+
+  // Thread w runs on node w % nodes
+  for (w=0; w<threads; w++) {
+    int n = w % nodes;
+    m_worker_replica[w] = (m_numa == ePCR_NUMA_REPLICATE) ? n : 0;
+    ePCR_PoolPin (m_pool, w, m_numa_nodes->cpus + m_numa_nodes->first[n],
+		  m_numa_nodes->first[n+1] - m_numa_nodes->first[n]);
+  }
+  memcpy (&m_replicated, &m_search, sizeof(epcr_search_t));
 
   if (!ePCR_quiet)
-    fprintf (stderr, "sequence length=%lu\n", (unsigned long) seq_len);
-
-  for (i = 0; i<num_threads; i++) {
-    arg_array[i].id = i;
-    arg_array[i].object_ptr = this;
-    arg_array[i].offset = offset;
-    arg_array[i].data = (char *)seq_data + offset;
-    arg_array[i].length = (i < num_threads - 1) ? length : seq_len - offset;
-    arg_array[i].num_hits = 0;
-    arg_array[i].num_hits_allocated = 0;
-    arg_array[i].hits = NULL;
-    int rv;
+    fprintf (stderr, "%s the index (%lu MB) %s %d%s NUMA nodes\n",
+	     m_numa == ePCR_NUMA_REPLICATE ? "Copied" : "Interleaved",
+	     (unsigned long) (m_replica_size >> 20),
+	     m_numa == ePCR_NUMA_REPLICATE ? "to" : "over",
+	     m_numa == ePCR_NUMA_REPLICATE ? m_num_replicas : nodes,
+	     m_numa_nodes->simulated ? " simulated" : "");
+}
 
-    if (!ePCR_quiet) {
-      fprintf (stderr, "thread %d will search from offset = %lu to %lu (length = %lu)\n", 
-	       (int)i,
-	       (unsigned long)arg_array[i].offset,
-	       (unsigned long)arg_array[i].offset + (unsigned long)arg_array[i].length - 1,
-	       (unsigned long)arg_array[i].length);
-      fprintf (stderr, "--> leading m_overlap = %u\n", (unsigned) (last_offset - arg_array[i].offset + 1)); 
-      last_offset = (long)arg_array[i].offset + (long)arg_array[i].length - 1;
-    }
-    offset += (length - m_overlap);
-    
-    //    rv = pthread_create(threads+i, NULL, ((void *)(*)(void *))ThreadProc, (void *)(arg_array+i));
 
-    rv = pthread_create(threads+i, NULL, ThreadProc, arg_array+i);
+// The STS a copy has in place of sts, in the STS's of a copy
+static inline STS *CopyOf (const STS *sts, STS *copies)
+{
+  return sts ? copies + sts->id : NULL;
+}
 
-    if (rv != 0) {
-      fprintf (stderr, "error starting thread %d of %d. Code=%d\n", i+1, num_threads,rv);
-      exit(1);
+static inline char *CopyBytes (char *&to, const void *from, size_t n)
+{
+  char *start = to;
+  memcpy (to, from, n);
+  to += n;
+  return start;
+}
+
+// Make replica r of the index, on NUMA node node (-1 to interleave it)
+
+void PCRmachine::CopyIndex (int replica, int node)
+{
+  epcr_search_t *copy = m_replicas + replica;
+  char *p = (char *) ePCR_NumaAlloc (m_numa_nodes, node, m_replica_size);
+  epcr_ac_state_t *states = NULL;
+  STS **table, **right = NULL, **residual = NULL, *copies;
+  unsigned long long *occupied = NULL;
+  epcr_automaton_t *ac = NULL;
+  unsigned h, i;
+
+  m_replica_memory[replica] = p;
+  memcpy (copy, &m_search, sizeof(epcr_search_t));
+
+  if (m_search.ac) {
+    states = (epcr_ac_state_t *) CopyBytes (p, m_search.ac->states,
+					   m_search.ac->num_states * sizeof(epcr_ac_state_t));
+    ac = (epcr_automaton_t *) CopyBytes (p, m_search.ac, sizeof(epcr_automaton_t));
+    residual = (STS **) p;
+    p += m_asize * sizeof(STS *);
+  }
+  table = (STS **) p;
+  p += m_asize * sizeof(STS *);
+  if (m_search.sts_table_right) {
+    right = (STS **) p;
+    p += m_asize * sizeof(STS *);
+  }
+  if (m_search.occupied)
+    occupied = (unsigned long long *) CopyBytes (p, m_search.occupied,
+						 (m_asize + 63) / 64 * sizeof(unsigned long long));
+  copies = (STS *) p;
+  p += m_sts_count * sizeof(STS);
+
+  for (STS *s = m_last_global_sts; s; s = s->global_prev) {
+    STS *c = new (copies + s->id) STS (*s);
+    c->next = CopyOf (s->next, copies);
+    c->next_right = CopyOf (s->next_right, copies);
+    c->next_ac = CopyOf (s->next_ac, copies);
+    c->global_prev = NULL;   // the copies are never deleted
+    c->pcr_p1 = CopyBytes (p, s->pcr_p1, s->p1_len + 1);
+    c->pcr_p2 = CopyBytes (p, s->pcr_p2, s->p2_len + 1);
+    if (s->p1_iupac)
+      c->p1_iupac = (unsigned char *) CopyBytes (p, s->p1_iupac, s->p1_len);
+    if (s->p2_iupac)
+      c->p2_iupac = (unsigned char *) CopyBytes (p, s->p2_iupac, s->p2_len);
+  }
+
+  for (h=0; h<m_asize; h++) {
+    table[h] = CopyOf (m_search.sts_table[h], copies);
+    if (right)
+      right[h] = CopyOf (m_search.sts_table_right[h], copies);
+    if (residual)
+      residual[h] = CopyOf (m_search.ac->residual[h], copies);
+  }
+  copy->sts_table = table;
+  copy->sts_table_right = right;
+  copy->occupied = occupied;
+  if (ac) {
+    for (i=0; i<ac->num_states; i++)
+      states[i].out = CopyOf (states[i].out, copies);
+    ac->states = states;
+    ac->residual = residual;
+    copy->ac = ac;
+  }
+}
+
+
+void PCRmachine::FreeReplicas (void)
+{
+  for (int r=0; r<m_num_replicas; r++)
+    ePCR_NumaDealloc (m_replica_memory[r], m_replica_size);
+  MemDealloc (m_replicas);
+  MemDealloc (m_replica_memory);
+  MemDealloc (m_worker_replica);
+  m_num_replicas = 0;
+}
+
+
+// Next free slot in the ring of tasks, its hit list emptied; if they
+// are all in use, wait for the oldest to be searched and reported.
+
+epcr_thread_args_t *PCRmachine::AddTask (void)
+{
+  if (m_next_task - m_written == (unsigned long) m_num_args)
+    WriteTasks (m_written + 1);
+
+  epcr_thread_args_t *args = m_args + m_next_task % m_num_args;
+  args->object_ptr = this;
+  args->num_hits = 0;
+  args->formatted = FALSE;
+  args->done = FALSE;
+  return args;
+}
+
+
+// Report the hits of the tasks in order, as far as the first one that
+// hasn't finished, waiting for them up to task number until.  The
+// buffers of a task that had a great many hits are freed.
+
+#define ePCR_KEEP_BUFFER (1 << 20)
+
+void PCRmachine::WriteTasks (unsigned long until)
+{
+  pthread_mutex_lock (&m_lock);
+  while (m_written < m_next_task) {
+    epcr_thread_args_t *args = m_args + m_written % m_num_args;
+    if (!args->done) {
+      if (m_written >= until)
+	break;
+      pthread_cond_wait (&m_task_done, &m_lock);
+      continue;
+    }
+    pthread_mutex_unlock (&m_lock);
+
+    ReportHits (args, 1);
+    if (args->num_hits_allocated * sizeof(epcr_hit_t) > ePCR_KEEP_BUFFER) {
+      MemDealloc (args->hits);
+      args->num_hits_allocated = 0;
+    }
+    if (args->text_allocated > ePCR_KEEP_BUFFER) {
+      MemDealloc (args->text);
+      args->text_allocated = 0;
     }
 
-  } // end for
+    pthread_mutex_lock (&m_lock);
+    m_written++;
+  }
+  pthread_mutex_unlock (&m_lock);
+}
+
 
-  // Now just wait for the threads to complete ...
+// Queue a sequence for the search threads, cut into tasks (see
+// epcr_thread_args_t): short sequences are a task each, so the threads
+// work on different ones, and long ones are cut into many pieces, so
+// that the threads can share out a stretch dense in hash hits.
+// Each task owns the hash words from its scan_begin up to the next
+// task's, so every primer is tried exactly once, and its data reaches
+// m_overlap bases before and after them.  The tasks start as soon as
+// they are queued, and their hits are reported in order, by this
+// thread, as soon as the tasks before them are done: from here and
+// FlushSeqs().  seq_label and seq_data must stay valid until then.
+// Call FlushSeqs() before changing the search parameters.
 
-  for (i = 0; i<num_threads; i++) {
-    /* joins the threads */
-    pthread_join(threads[i], NULL);
+int PCRmachine::QueueSeq (const char *seq_label, const char *seq_data, size_t seq_len)
+{
+  return QueueSeqWindow (seq_label, seq_data, seq_len, TRUE);
+}
+
+
+// Queue a sequence that is still being read: seq_len bases of it are
+// in seq_data so far, and complete is TRUE once they all are.  Call
+// it with the same seq_data each time more have been read.  Tasks of
+// m_task_length are queued as soon as their data is all there; the
+// rest is cut up as by QueueSeq() when the sequence is complete.
+
+int PCRmachine::QueueSeqWindow (const char *seq_label, const char *seq_data, size_t seq_len, int complete)
+{
+  size_t num_chunks = 1, i;
+
+  if (seq_data != m_window_data) {
+    if (m_next_task == m_written)
+      StartTasks();
+
+    if (!ePCR_quiet)
+      fprintf (stderr, "Processing seq: '%s': m_overlap is %lu (from max_pcr_size of %lu and m_margin of %lu)\n", 
+	       seq_label,
+	       (unsigned long)m_overlap, 
+	       (unsigned long)max_pcr_size, 
+	       (unsigned long) m_margin);
+
+    m_window_data = seq_data;
+    m_window_begin = 0;
   }
-  
-  // Report on the results.  All the threads have deposited their results in their 
-  // private args structures.  There may be some duplicate hits.
-  ReportHits (seq_label, arg_array, num_threads);
-
-  for (i = 0; i<num_threads; i++) {
-    /* joins the threads */
-    if (arg_array[i].hits) 
-      MemDealloc (arg_array[i].hits);
+
+  // A right primer may also end in the word after the last one tried
+  size_t after = (m_overlap > m_wsize) ? m_overlap + 1 : m_wsize + 1;
+
+  if (!complete) {
+    // Leave at least a task's worth for the end, to be cut up with it
+    while (m_window_begin + 2*m_task_length + after <= seq_len) {
+      QueueTask (seq_label, seq_data, seq_len, m_window_begin, m_window_begin + m_task_length, FALSE);
+      m_window_begin += m_task_length;
+    }
+  } else {
+    // (With one thread too, so that the hits of a task are written
+    // before the next one starts)
+    size_t rest = seq_len - m_window_begin;
+    size_t fewest = rest / m_min_task_length;
+    if (fewest > (size_t) ePCR_threads)
+      fewest = ePCR_threads;
+    num_chunks = rest / m_task_length;
+    if (num_chunks < fewest)
+      num_chunks = fewest;
+    if (num_chunks < 1)
+      num_chunks = 1;
+
+    for (i=0; i<num_chunks; i++) {
+      size_t begin = m_window_begin + rest / num_chunks * i;
+      size_t end = (i == num_chunks-1) ? seq_len : m_window_begin + rest / num_chunks * (i+1);
+      QueueTask (seq_label, seq_data, seq_len, begin, end, i == num_chunks-1);
+    }
+    m_window_data = NULL;
   }
-  
-  if (!ePCR_quiet) fprintf (stderr, "after joining threads\n");
 
-  MemDealloc(threads);
-  MemDealloc(arg_array);
-     
-  return 0;  
+  // Write what's ready
+  WriteTasks (m_written);
+  return 0;
+}
 
-} // end ProcessSeq
+
+// Queue the task that owns the words from begin up to end of a
+// sequence of which seq_len bases are known, or a task for each shard
+// of the STS's.  The pool deals them out to its threads in turn, so
+// with as many shards as threads, each thread searches the same one.
+
+void PCRmachine::QueueTask (const char *seq_label, const char *seq_data, size_t seq_len,
+			    size_t begin, size_t end, int last)
+{
+  size_t after = (m_overlap > m_wsize) ? m_overlap + 1 : m_wsize + 1;
+  size_t from = (begin > m_overlap) ? begin - m_overlap : 0;
+  size_t to = (seq_len - end > after) ? end + after : seq_len;
+  unsigned long group = m_next_task;
+  int s;
+
+  for (s=0; s<m_num_shards; s++) {
+    epcr_thread_args_t *args = AddTask();
+
+    args->seq_label = seq_label;
+    args->offset = from;
+    args->data = (char *)seq_data + from;
+    args->length = to - from;
+    args->scan_begin = begin - from;
+    args->scan_end = end - from;
+    args->last = last && s == m_num_shards-1;
+    args->num_shards = m_num_shards;
+    args->group = group;
+    if (m_num_shards > 1) {
+      args->shard_first = m_shard_bounds[s];
+      args->shard_last = m_shard_bounds[s+1] - 1;
+    }
+    if (s == 0)
+      args->shards_left = m_num_shards;
+
+    if (!ePCR_quiet)
+      fprintf (stderr, "task %lu will search from offset = %lu to %lu (words %lu to %lu)\n", 
+	       m_next_task,
+	       (unsigned long)from, (unsigned long)to - 1,
+	       (unsigned long)begin, (unsigned long)end - 1);
+
+    ePCR_PoolSubmit (m_pool, RunTask, this, m_next_task++ % m_num_args);
+  }
+}
 
 
+// Wait for the queued tasks and report their hits
+
+int PCRmachine::FlushSeqs (void)
+{
+  WriteTasks (m_next_task);
+  ePCR_PoolWait (m_pool);
+  if (!ePCR_quiet) fprintf (stderr, "after joining threads\n");
+  return 0;
+}
+
 
 /* This is the actual search algorithm
- * seq_data is upcased, whitespace-stripped sequence data
- * _scode is an array of 128 bytes, with ACGT mapped to 0,1,2,3, and everything else
- * mapped to 100 (AMBIG).
+ * seq_data is upcased, whitespace-stripped sequence data.  The scan
+ * itself is done by the kernel selected for this CPU (kernels.cpp).
  */
-int PCRmachine::ProcessSeqThread (epcr_thread_args_t *args)
+// The fm engine: find the left primers of all the STS's in the FM
+// index of the sequence file (ePCR_FmFindLeft()), then verify them
+// sequence by sequence in the order the hash scan would have tried
+// them (by the position of the hash word, then by position in the
+// hash table bucket), so the output is the same.
+
+typedef struct {
+  unsigned seq;
+  unsigned seed;   // position of the hash word in the sequence
+  unsigned chain_rank;
+  unsigned k;      // position of the left primer
+  const STS *sts;
+} epcr_fm_candidate_t;
+
+static int CompareFmCandidates (const void *a, const void *b)
 {
-  size_t seq_len = args->length;
-  const char * seq_data = args->data;
+  const epcr_fm_candidate_t *x = (const epcr_fm_candidate_t *) a;
+  const epcr_fm_candidate_t *y = (const epcr_fm_candidate_t *) b;
+
+  if (x->seq != y->seq)
+    return x->seq < y->seq ? -1 : 1;
+  if (x->seed != y->seed)
+    return x->seed < y->seed ? -1 : 1;
+  if (x->chain_rank != y->chain_rank)
+    return x->chain_rank < y->chain_rank ? -1 : 1;
+  return 0;
+}
+
+int PCRmachine::ProcessIndex (const epcr_fm_index_t *fm)
+{
+  epcr_fm_hits_t found = { NULL, 0, 0 };
+  epcr_fm_candidate_t *cand = NULL;
+  size_t num_cand = 0, cand_allocated = 0, c;
+  unsigned i;
   int count = 0;
+
+  PrepareSearch();
+
+  for (unsigned int h=0; h<m_asize; h++)
+    for (STS *sts = m_sts_table[h]; sts; sts = sts->next) {
+      found.num = 0;
+      ePCR_FmFindLeft(fm, sts, m_wsize, m_mmatch, found);
+      for (c=0; c<found.num; c++) {
+	// The sequence the primer starts in; the hash scan never tries
+	// the last word of a sequence
+	unsigned lo = 0, hi = fm->num_seqs;
+	while (hi - lo > 1) {
+	  unsigned mid = (lo + hi) / 2;
+	  if (fm->seq_start[mid] <= found.pos[c])
+	    lo = mid;
+	  else
+	    hi = mid;
+	}
+	unsigned k = found.pos[c] - fm->seq_start[lo];
+	if ((size_t)k + sts->hash_offset + m_wsize >= fm->seq_len[lo])
+	  continue;
+	if (num_cand == cand_allocated) {
+	  cand_allocated = cand_allocated ? 2*cand_allocated : 256;
+	  if (!MemResize(cand, cand_allocated*sizeof(epcr_fm_candidate_t))) {
+	    fprintf (stderr, "Out of memory in the fm engine\n");
+	    exit(1);
+	  }
+	}
+	cand[num_cand].seq = lo;
+	cand[num_cand].seed = k + sts->hash_offset;
+	cand[num_cand].chain_rank = sts->chain_rank;
+	cand[num_cand].k = k;
+	cand[num_cand].sts = sts;
+	num_cand++;
+      }
+    }
+  MemDealloc(found.pos);
+
+  if (!ePCR_quiet)
+    fprintf (stderr, "fm engine: %lu candidate left primers\n", (unsigned long) num_cand);
+  qsort (cand, num_cand, sizeof(epcr_fm_candidate_t), CompareFmCandidates);
+
+  for (i=0, c=0; i<fm->num_seqs; i++) {
+    epcr_thread_args_t args;
+    memset (&args, 0, sizeof(args));
+    args.object_ptr = this;
+    args.seq_label = fm->labels + fm->label_offset[i];
+    args.data = fm->text + fm->seq_start[i];
+    args.length = fm->seq_len[i];
+    args.scan_end = args.length;
+    args.last = 1;
+    for (; c<num_cand && cand[c].seq == i; c++)
+      count += ePCR_GetKernels()->match(&m_search, &args, cand[c].k, cand[c].sts);
+    ReportHits (&args, 1);
+    MemDealloc (args.hits);
+  }
+  MemDealloc(cand);
+
+  return count;
+}
+
+
+int PCRmachine::ProcessSeqThread (epcr_thread_args_t *args)
+{
+  int count;
   time_t start_time = 0;  // 0 just to suppress warning ...
 #ifdef EPCR_STATS
   args->hash_hits = 0;
   args->comparisons = 0;
   args->string_comparisons = 0;
+  args->sts_switches = 0;
+  args->batches = 0;
 #endif
 
 #ifdef TIME_TRIAL
@@ -627,135 +1434,27 @@ int PCRmachine::ProcessSeqThread (epcr_thread_args_t *args)
     start_time = time(NULL);
     fprintf (stderr, "Processing the sequence ...\n");
   }
-  
-  if (seq_data && seq_len > m_wsize)
-    {
-      unsigned int h;
-      const char *p = seq_data;
-      int i, j, k, pos, N;
-      
-      /* kpm: A nice simple hash.  Actually, we're just
-       * discarding the unused bits from each character and squeezing 
-       * as many 2-bit symbols as possible into a variable.
-       */
-      for(i=N=0, h=0; (unsigned)i<m_wsize; i++)
-	{
-	  /// Initialize the hash value h with the first 
-	  h <<= 2;
-	  if ((j=_scode[*p++]) ==AMBIG)
-	    {
-	      N = m_wsize;
-	    }
-	  else
-	    {
-	      if (N >0) N--;
-	      h |= (unsigned int) j;
-	    }
-	}
-      
-      // Notice that pos is not involved in loop termination
-      // and that throughout the loop, 
-      // pos = (p-m_wsize) - seq_data
-      // i.e., pos is "m_wsize behind p".
-      // First time through, pos=0 and p=seq_data+m_wsize.
 
-      for (pos=0; (size_t)(p-seq_data)<seq_len; ++pos)
-	{
-	  // If N > 0, it means there was an N within the last m_wsize
-	  // characters, so we know we don't have a valid hash value
-	  // to test.
-	  if (N == 0)
-	    {
-	      STS *sts = m_sts_table[h];
-	      while (sts)
-		{ 
-#ifdef DEBUG
-		  fprintf (stderr, "hash hit: %s/%s\n", sts->pcr_p1, sts->pcr_p2);
-#endif
-#ifdef EPCR_STATS
-		  args->hash_hits++;
-#endif
-		  /* 
-		   * When a hash match occurs, p points to the
-		   * character after the last character of the
-		   * m_wsize-sized match region, and pos indexes the
-		   * first character of the match region.
-		   *
-		   * k indexes the first character of the primer.
-		   *
-		   * Note: the comparison against 0 is rather
-		   * regrettable since it only applies to the first
-		   * handful out of millions of comparisons.  For real
-		   * speed we should prime the algorithm up to the
-		   * point where this comparison is not needed.
-		   */
-		  k = pos - sts->hash_offset;
-		  if (k>=0)
-		     count += Match(
-				    seq_data+k,
-				    seq_len-k,
-				    k,
-				    sts, 
-				    args
-				    );
-		  sts = sts->next;
-		}  // end while
-#ifdef EPCR_STATS
-	      args->comparisons++;
-#endif
-	    }  // end if N==0
-
-	  // Update the hash value.  If an ambiguous base (e.g. "N")
-	  // is encountered, the hash is disqualified for wordsize
-	  // bases after that.  We don't automatically forward the
-	  // pointers by wordsize, but it doesn't seem to affect the
-	  // speed.
-	  h <<= 2;
-	  h &= m_mask;
-	  if ((j=_scode[*p++]) == AMBIG)
-	    { 
-	      // Interestingly, it doesn't really pay to try to scan for an entire block of N's here.
-	      // And it will only pay less and less as time goes on ... so we won't.
-	      N = m_wsize;
-	    }
-	  else
-	    {
-	       if (N>0) N--;
-	       h |= (unsigned int) j;
-	    }
-	  
-#ifdef TIME_TRIAL	  
-			// For the Mac, allow e-PCR to operate in the background and play nice 
-#ifdef __MWERKS__
-	  TimeSlice();
-#endif			
-	  
-	  // Output a progress indication
-	  if (!ePCR_quiet) {
-	    static int percent_done;
-	    static clock_t last_clock;
-	    clock_t this_clock;
-	    float fract;
-	    if ((this_clock = clock()) != last_clock) {
-	      last_clock = this_clock;
-	      fract = (float)(p-seq_data)/seq_len;
-	      if (fract > percent_done/100.0) {
-		percent_done  = (int) ceil(fract*100);
-		fprintf (stderr, "\t%3d %% done; time spent: %d secs; hash hits: %lu; hash looks: %lu\n", 
-			 percent_done-1, (int) (time(NULL)-start_time), args->hash_hits, args->comparisons);
-	      }
-	    }
-	  }
-#endif // TIME_TRIAL	  
-	}
-    }
-  
+  if (args->num_shards <= 1) {
+    args->shard_first = 0;
+    args->shard_last = ~0UL;
+  }
+
+  const epcr_search_t *search = args->search ? args->search : &m_search;
+  if (m_engine == ePCR_ENGINE_JOIN)
+    count = ePCR_GetKernels()->scan_join(search, args);
+  else if (m_engine == ePCR_ENGINE_BATCH)
+    count = ePCR_GetKernels()->scan_batch(search, args);
+  else if (m_engine == ePCR_ENGINE_AC && search->ac)
+    count = ePCR_GetKernels()->scan_ac(search, args);
+  else
+    count = ePCR_GetKernels()->scan(search, args);
 
 #ifdef TIME_TRIAL
   fprintf (stderr, "Elapsed time processing the sequence: %f seconds\n\n", 
 	   (float) (clock()-start_clock) / CLOCKS_PER_SEC);
   fprintf (stderr, "\thash hits: %lu; hash looks: %lu; total sequence length: %lu\n", 
-			 args->hash_hits, args->comparisons, seq_len);
+			 args->hash_hits, args->comparisons, (unsigned long) args->length);
 #endif
   
   if (!ePCR_quiet) {
@@ -766,140 +1465,242 @@ int PCRmachine::ProcessSeqThread (epcr_thread_args_t *args)
 }
 
 
-/*
-  PCRmachine::Match()
+// Bit mask of the primer positions (up to 64) in which the X= option
+// disallows mismatches, for the vectorized primer comparison.  strand
+// is as for seqmcmp() in kernels.cpp, and so is the (unsigned) window
+// arithmetic, so that X larger than the primer behaves the same.
+static unsigned long long three_prime_mask (int len, unsigned three_prime_match, int strand)
+{
+  unsigned long long mask = 0;
+  int i;
 
-  Once a hash hit on the left primer has occurred, Match() determines
-  via brute force whether the whole STS matches the underlying
-  sequence.  In doing so, Match() uses the expected PCR size and
-  allowable margin (M) to find the right primer.  In the worst case,
-  Match() will perform 2*M+1 string comparisons (via seqmcmp()) trying
-  to find the right primer.
+  for (i=0; i<len && i<64; i++)
+    if ((strand > 0 && (unsigned)i >= len-three_prime_match)
+	|| (strand < 0 && (unsigned)i < three_prime_match))
+      mask |= 1ULL << i;
+  return mask;
+}
 
-  Note: Match() always starts its search at the expected PCR size and
-  gradually widens its search from there.  This makes sense since the
-  graph of found versus expected size is a steep bell curve centered
-  on the expected size.
 
-  Note: There is various annoying logic here which prevents Match()
-  from searching before the beginning of left primer (and hence,
-  indirectly, before the beginning of the entire sequence, yikes) and
-  also from searching beyond the end of the entire sequence.
+// Pack a primer two bits per base (see epcr_packed_primer_t).  Returns
+// FALSE if the primer is too short or too long, or contains anything
+// but A, C, G and T; such primers are compared byte by byte.
+static int pack_primer (const char *primer, int len, unsigned long long three_prime_mask,
+			epcr_packed_primer_t *packed)
+{
+  int i;
 
-  Hits are recorded by calling RecordHit() as they are encountered.
+  if (len < ePCR_PACKED_PRIMER_MIN || len > ePCR_PACKED_PRIMER_MAX)
+    return FALSE;
+
+  memset (packed, 0, sizeof(*packed));
+  for (i=0; i<len; i++) {
+    char c = primer[i];
+    if (c != 'A' && c != 'C' && c != 'G' && c != 'T')
+      return FALSE;
+    packed->bases[i/32] |= (unsigned long long)((c >> 1) & 3) << (2*(i%32));
+    if (three_prime_mask & (1ULL << i))
+      packed->three_prime[i/32] |= 1ULL << (2*(i%32));
+  }
+  return TRUE;
+}
 
- Return value: the number of hits.
 
- */
-inline int PCRmachine::Match (
-			      const char *seq,  // Pointer to the beginning of the left primer in the sequence
-			      size_t seq_len,   // Length of entire remaining sequence
-			      int k,            // k indexes the first character of the primer
-			      const STS *sts,   // The STS we're looking for
-			      epcr_thread_args_t *args  // For storing statistics
-			      ) 
-{
-   size_t len_p1 = sts->p1_len;
-   size_t margin = sts->margin;
-   int count = 0;
-   
-#ifdef EPCR_STATS
-   args->string_comparisons++;
+// Precompute the primer data of sts that depends on the X= option: the
+// 3' masks used by the vector kernels and the packed primers.
+void PCRmachine::SetPrimerMasks (STS *sts)
+{
+  sts->p1_3prime_mask = three_prime_mask(sts->p1_len, m_three_prime_match, +1);
+  sts->p2_3prime_mask = three_prime_mask(sts->p2_len, m_three_prime_match, -1);
+  sts->packed_primer = 0;
+  if (pack_primer(sts->pcr_p1, sts->p1_len, sts->p1_3prime_mask, &sts->p1_packed))
+    sts->packed_primer |= PRIMER1;
+  if (pack_primer(sts->pcr_p2, sts->p2_len, sts->p2_3prime_mask, &sts->p2_packed))
+    sts->packed_primer |= PRIMER2;
+}
+
+
+void PCRmachine::InsertSTS (STS *sts, unsigned hash)
+{
+  SetPrimerMasks(sts);
+
+  // Use hash value as index into array, insert item
+#ifdef DEBUG
+  fprintf(stderr,"Inserting STS: hash = %d (0x%04x), hash offset = %d, p1 = %s, p2 = %s, margin = %d, size = %d, ambig_primer = %d\n",
+	  hash, hash, sts->hash_offset, sts->pcr_p1, sts->pcr_p2, sts->margin, sts->pcr_size, sts->ambig_primer);
 #endif
+  sts->next = m_sts_table[hash];
+  m_sts_table[hash] = sts;
+  sts->id = m_sts_count++;
+  m_index_bytes += sizeof(STS) + sts->p1_len + sts->p2_len + 2;
+  if (m_last_global_sts)
+    sts->global_prev = m_last_global_sts;
+  m_last_global_sts = sts;
+}
 
-  if ( ((sts->ambig_primer&PRIMER1)?seqmcmp_ambig(seq,sts->pcr_p1,len_p1,+1):seqmcmp(seq,sts->pcr_p1,len_p1,+1))==0)
-    {
-      size_t len_p2 = sts->p2_len;
-      size_t lo_margin, hi_margin;
-      size_t exp_size = sts->pcr_size;
 
-      // boundary check: we're not allowed to start looking after the end of the sequence!
-      if (exp_size > seq_len) {
+// Build the table the join engine uses to find right primers, hashed
+// on a word of the right primer (STS::pcr_p2).  Unless N=0 that word
+// has to lie within the X= bases at the 3' end of the primer (the start
+// of pcr_p2), where no mismatches are allowed, or the join could miss
+// hits; STS's without such a word keep p2_hash_offset = -1 and are
+// searched the usual way.
 
-	// We'd like to coerce exp_size, but let's see if we can even do that ...
+void PCRmachine::BuildJoinTable (void)
+{
+  STS *sts;
+  unsigned long joined = 0;
 
-	if (seq_len < len_p1 + len_p2)
-	  // no, this STS can't possibly fit this close to the end of the sequence
-	  return 0;
+  m_sts_table_right = new STS*[m_asize];
+  memset((void*)m_sts_table_right,0,m_asize*sizeof(STS*));
 
-	// yes, set exp_size to the maximum possible value
-	exp_size = seq_len;
-	hi_margin = 0;
-	
-      } else {
+  for (sts = m_last_global_sts; sts; sts = sts->global_prev) {
+    unsigned hash;
+    int offset, len = sts->p2_len;
 
-	// Keep exp_size the same, and ...
-	hi_margin = margin;
-	// Make sure that hi_margin will not extend our search beyond the sequence end.
-	if ( (hi_margin + exp_size) > seq_len)
-	  hi_margin = seq_len - exp_size;   // Note that in this if clause we are guaranteed that seq_len >= exp_size
-      }
+    if (m_mmatch != 0 && m_three_prime_match < (unsigned) len)
+      len = m_three_prime_match;
+    if (len < (int) m_wsize || (offset = HashValue(sts->pcr_p2, len, hash)) == -1) {
+      sts->p2_hash_offset = -1;
+      continue;
+    }
+    sts->p2_hash_offset = offset;
+    sts->next_right = m_sts_table_right[hash];
+    m_sts_table_right[hash] = sts;
+    joined++;
+  }
 
-      // assert: seq_len >= exp_size
+  if (!ePCR_quiet)
+    fprintf (stderr, "join engine: %lu of %lu STS's hashed on both primers\n", joined, m_sts_count);
+}
 
-      lo_margin = margin;
-      if (lo_margin > exp_size - len_p1 - len_p2)
-	lo_margin = exp_size - len_p1 - len_p2;  
-      
-      // assert: lo_margin >= 0, because when the STS was created, exp_size was coerced to be >= len_p1 + len_p2
 
-      assert ((int)seq_len >= (exp_size-lo_margin));
+// Build the bitmap the batch engine uses to skip empty buckets of
+// m_sts_table without touching the table itself (one bit per bucket).
+void PCRmachine::BuildOccupancy (void)
+{
+  unsigned int h, words = (m_asize + 63) / 64;
 
-      
-      /*      fprintf (stderr, "m,lo,hi=%d,%d,%d, p1=%s, lenp1,lenp2,stslen=%d,%d,%d, seq_len=%d\n",
-	      margin, lo_margin, hi_margin, sts->pcr_p1, len_p1, len_p2, sts->pcr_size, (int)seq_len); */
+  m_occupied = new unsigned long long[words];
+  memset((void*)m_occupied,0,words*sizeof(unsigned long long));
+  for (h=0; h<m_asize; h++)
+    if (m_sts_table[h])
+      m_occupied[h >> 6] |= 1ULL << (h & 63);
+}
 
-#define P2_SEQMCMP(ptr,p2,len,strand) ((sts->ambig_primer&PRIMER2)?seqmcmp_ambig(ptr,p2,len,strand):seqmcmp(ptr,p2,len,strand))
 
-#ifdef EPCR_STATS
-  args->string_comparisons++;
-#endif
 
-      const char *p = seq + (exp_size - len_p2);
-      if (seq_len>=exp_size && P2_SEQMCMP(p,sts->pcr_p2,len_p2,-1)==0)
-	{
-	   RecordHit(args, k, k+exp_size-1, sts);
-	   count++;
-	}
-      
-      size_t i;
-      for (i=1; i<=margin; ++i)
-	{
-#ifdef EPCR_STATS
-  args->string_comparisons++;
-#endif
-	  if (i<=lo_margin && P2_SEQMCMP(p-i,sts->pcr_p2,len_p2,-1)==0)
-	     {
-		RecordHit(args, k, k+exp_size-i-1, sts);
-		count++;
-	     }
-#ifdef EPCR_STATS
-	   args->string_comparisons++;
-#endif
-	  if (i<=hi_margin && P2_SEQMCMP(p+i,sts->pcr_p2,len_p2,-1)==0)
-	     {
-		RecordHit(args, k, k+exp_size+i-1, sts);
-		count++;
-	     }
+
+// Build the Aho-Corasick automaton the ac engine uses to find all the
+// left primers (STS::pcr_p1) in one pass over the sequence, whatever
+// their number.  Only exact matches can be found this way, so the
+// engine needs N=0.  Primers with IUPAC codes or other characters
+// besides A, C, G and T stay out of the automaton; they go into
+// m_ac->residual, a copy of m_sts_table with just those STS's, and are
+// searched the usual way.
+
+void PCRmachine::BuildAutomaton (void)
+{
+  unsigned allocated = 1024, head, tail;
+  unsigned *fail, *queue;
+  unsigned long primers = 0;
+  unsigned int h;
+
+  m_ac = new epcr_automaton_t;
+  m_ac->num_states = 1;
+  m_ac->num_residual = 0;
+  m_ac->residual = new STS*[m_asize];
+  memset((void*)m_ac->residual,0,m_asize*sizeof(STS*));
+  if (!MemAlloc(m_ac->states, allocated*sizeof(epcr_ac_state_t))) {
+    fprintf (stderr, "Out of memory building the ac engine automaton\n");
+    exit(1);
+  }
+  memset(m_ac->states,0,sizeof(epcr_ac_state_t));
+
+  // The trie of the left primers (a 0 transition means none yet)
+  for (h=0; h<m_asize; h++)
+    for (STS *sts = m_sts_table[h]; sts; sts = sts->next) {
+      const char *p = sts->pcr_p1;
+      unsigned state = 0;
+      int i;
+
+      for (i=0; i<sts->p1_len && _scode[(unsigned char)p[i]] != AMBIG; i++)
+	;
+      if (i < sts->p1_len || (sts->ambig_primer & PRIMER1)) {
+	sts->next_ac = m_ac->residual[h];
+	m_ac->residual[h] = sts;
+	m_ac->num_residual++;
+	continue;
+      }
+      for (i=0; i<sts->p1_len; i++) {
+	int c = _scode[(unsigned char)p[i]];
+	if (m_ac->states[state].next[c] == 0) {
+	  if (m_ac->num_states == allocated) {
+	    if (allocated > UINT_MAX/2) {
+	      fprintf (stderr, "Too many primers for the ac engine automaton\n");
+	      exit(1);
+	    }
+	    allocated *= 2;
+	    if (!MemResize(m_ac->states, allocated*sizeof(epcr_ac_state_t))) {
+	      fprintf (stderr, "Out of memory building the ac engine automaton\n");
+	      exit(1);
+	    }
+	  }
+	  memset(m_ac->states+m_ac->num_states,0,sizeof(epcr_ac_state_t));
+	  m_ac->states[state].next[c] = m_ac->num_states++;
 	}
+	state = m_ac->states[state].next[c];
+      }
+      sts->next_ac = m_ac->states[state].out;
+      m_ac->states[state].out = sts;
+      primers++;
     }
-   return count;
+
+  // Failure links, breadth first, completing the transitions as we go
+  if (!MemAlloc(fail, m_ac->num_states*sizeof(unsigned))
+      || !MemAlloc(queue, m_ac->num_states*sizeof(unsigned))) {
+    fprintf (stderr, "Out of memory building the ac engine automaton\n");
+    exit(1);
+  }
+  fail[0] = 0;
+  head = tail = 0;
+  for (int c=0; c<4; c++) {
+    unsigned t = m_ac->states[0].next[c];
+    if (t) {
+      fail[t] = 0;
+      queue[tail++] = t;
+    }
+  }
+  while (head < tail) {
+    unsigned s = queue[head++];
+    for (int c=0; c<4; c++) {
+      unsigned t = m_ac->states[s].next[c];
+      if (t) {
+	unsigned f = m_ac->states[fail[s]].next[c];
+	fail[t] = f;
+	m_ac->states[t].dict = m_ac->states[f].out ? f : m_ac->states[f].dict;
+	queue[tail++] = t;
+      } else
+	m_ac->states[s].next[c] = m_ac->states[fail[s]].next[c];
+    }
+  }
+  MemDealloc(fail);
+  MemDealloc(queue);
+
+  if (!ePCR_quiet)
+    fprintf (stderr, "ac engine: %u states for %lu left primers; %lu STS's searched by hash\n",
+	     m_ac->num_states, primers, m_ac->num_residual);
 }
 
 
-void PCRmachine::InsertSTS (STS *sts, unsigned hash)
+void PCRmachine::FreeAutomaton (void)
 {
-  // Use hash value as index into array, insert item
-#ifdef DEBUG
-  fprintf(stderr,"Inserting STS: hash = %d (0x%04x), hash offset = %d, p1 = %s, p2 = %s, margin = %d, size = %d, ambig_primer = %d\n",
-	  hash, hash, sts->hash_offset, sts->pcr_p1, sts->pcr_p2, sts->margin, sts->pcr_size, sts->ambig_primer);
-#endif
-  sts->next = m_sts_table[hash];
-  m_sts_table[hash] = sts;
-  m_sts_count++;
-  if (m_last_global_sts)
-    sts->global_prev = m_last_global_sts;
-  m_last_global_sts = sts;
+  if (m_ac) {
+    MemDealloc(m_ac->states);
+    delete [] m_ac->residual;
+    delete m_ac;
+    m_ac = NULL;
+  }
 }
 
 
@@ -928,6 +1729,11 @@ int PCRmachine::ReadStsFile (const char *fname)
       fprintf(stderr,"Error: unable to open STS file: [%s]\n",fname);
       exit(1);
     }
+  if (!MemAlloc (m_fname, strlen(fname)+1)) {
+    fprintf (stderr, "out of memory\n");
+    exit (1);
+  }
+  strcpy (m_fname, fname);
   
   m_sts_table = new STS*[m_asize];
   memset((void*)m_sts_table,0,m_asize*sizeof(STS*));
@@ -1169,6 +1975,19 @@ int PCRmachine::ReadStsFile (const char *fname)
   if (!ePCR_quiet) {
     fprintf (stderr, "\t%3d %% done\n", 100);
   }
+
+  for (unsigned int h=0; h<m_asize; h++) {
+    unsigned rank = 0;
+    for (STS *s = m_sts_table[h]; s; s = s->next)
+      s->chain_rank = rank++;
+  }
+
+  // Tables derived from m_sts_table are rebuilt on next use
+  delete [] m_sts_table_right;
+  m_sts_table_right = NULL;
+  delete [] m_occupied;
+  m_occupied = NULL;
+  FreeAutomaton();
   
   if (bad1)
     {
@@ -1193,137 +2012,14 @@ int PCRmachine::ReadStsFile (const char *fname)
 }
 
 
-// Compute a hash value for the specified primer.  Note that the hash
-// value may not contain ambiguous bases (e.g. 'N').  If there is not
-// a valid hash value at the end of the primer (i.e. the last m_wsize
-// bases include an ambig), then the next earlier hash value is tried,
-// until the beginning of the primer is reached.  If no valid hash
-// value is found anywhere in the primer, -1 is returned.  Otherwise,
-// the offset to the hash value is returned.
+// Compute a hash value for the specified primer (see the hash kernel
+// in kernels.cpp).  If no valid hash value is found anywhere in the
+// primer, -1 is returned.  Otherwise, the offset to the hash value is
+// returned.
 
 int PCRmachine::HashValue (const char *primer, int primer_len, unsigned &hash_value)
 {
-  unsigned int h;
-  int i, j;
-  const char *p;
-  int offset = primer_len - m_wsize;
-  
-  do {    
-    p = primer + offset;
-    h = 0;
-    // If i ever equals m_wsize, we have found a good hash value.
-    for (i=0; (unsigned)i<m_wsize; ++i)
-      {
-	if ((j=_scode[*p++]) == AMBIG)
-	  {
-	    // Bad hash value means we have to jump back to the next
-	    // possible hash value (we "add" one because of the offset
-	    // decrement at the end of the while loop ....)
-	    offset -= (m_wsize - i - 1);
-	    break;
-	  }
-	h <<= 2;
-	h |= (unsigned int) j;
-      }  // endfor
-    
-    offset--;
-  } while ( (offset >= 0) && ((unsigned)i<m_wsize) );
-  
-  if ((unsigned)i < m_wsize) {
-    hash_value = 0x666;  // HEX value ;-)
-    return -1;
-  } else {
-    hash_value = h;
-    offset++; // bump it because we auto-decremented
-    return offset;  
-  }
-} // endfunc
-
-
-// Return 0 if two short pieces of sequence match, -1 otherwise,
-// subject to m_mmatch (number of allowed mismatches) and m_three_prime_match
-// (number of bases at the 3' end which MUST match).
-// See also seqmcmp_ambig below. 
-// Note that an 'N' in either primer or sequence can only match an 'N',
-// so essentially, any STS with an N in it is only going to be found
-// with N (mismatches) > 0.
-// s2 is the STS string; s1 is the underlying sequence.
-// strand is +1 if the 3' end is on the right and -1 if the 3' end is on the left.
-int PCRmachine::seqmcmp (const char *s1, const char *s2, int len, int strand)
-{
-  const char *p1 = s1;
-  const char *p2 = s2;
-  int i, n;
-  // Check mmatch so we can do slightly less work if the N parameter is 0
-  if (m_mmatch != 0) {
-    for (i=n=0; i<len; i++, p1++, p2++)
-      {
-	assert (*p1 != 0 && *p2 != 0);
-	if (*p1 != *p2)
-	  {
-	    n++;
-	    if (n>m_mmatch 
-		|| (strand > 0 && i >= len-m_three_prime_match)
-		|| (strand < 0 && i < m_three_prime_match)
-		)
-	      // No match if:
-	      // *) we exceed the total allowed mismatches per primer, OR
-	      // *) there is any mismatch with m_three_prime_match bases of 
-	      // the 3' end of the primer.
-	      return -1;
-	  }
-      }
-    return 0;   // 0 means it matches (like strcmp)
-  } else {
-    for (i=0; i<len; i++, p1++, p2++)
-      {
-	assert (*p1 != 0 && *p2 != 0);
-	if (*p1 != *p2)
-	  return -1;
-      }
-    return 0;   // 0 means it matches (like strcmp)
-  }
-}
-
-
-
-// Version of seqmcmp (above) that interprets ambiguous base symbols in the STS properly.
-// s2 is the STS string; s1 is the underlying sequence.
-int PCRmachine::seqmcmp_ambig (const char *s1, const char *s2, int len, int strand)
-{
-  const char *p1 = s1;
-  const char *p2 = s2;
-  int i, n;
-  
-  // Check mmatch so we can do slightly less work if the N parameter is 0
-  if (m_mmatch != 0) {
-    for (i=n=0; i<len; i++, p1++, p2++)
-      {
-	assert (*p1 != 0 && *p2 != 0);
-	if (!_IUPAC_match_matrix[ ((unsigned short)(*p1) << 8) + *p2])
-	  {
-	    n++;
-	    if (n>m_mmatch
-		|| (strand > 0 && i >= len-m_three_prime_match)
-		|| (strand < 0 && i < m_three_prime_match)
-		)
-	      // No match if:
-	      // *) we exceed the total allowed mismatches per primer, OR
-	      // *) there is any mismatch with m_three_prime_match bases of 
-	      // the 3' end of the primer.
-	      return -1;
-	  }
-      }
-    return 0;   // 0 means it matches (like strcmp)
-  } else {
-    for (i=0; i<len; i++, p1++, p2++)
-      {
-	assert (*p1 != 0 && *p2 != 0);
-	if (!_IUPAC_match_matrix[ ((unsigned short)(*p1) << 8) + *p2])
-	  return -1;
-      }
-    return 0;   // 0 means it matches (like strcmp)
-  }
+  return ePCR_GetKernels()->hash(primer, primer_len, m_wsize, hash_value);
 }
 
 
@@ -1361,13 +2057,24 @@ STS::STS (const char *p1, const char *p2, char d, int size, long offset, int mar
   margin = margin_to_use;
   hash_offset = p_hash_offset;
   ambig_primer = p_ambig_primer;
+  chain_rank = 0;
+  next_right = NULL;
+  next_ac = NULL;
+  p2_hash_offset = -1;
+  p1_iupac = (ambig_primer & PRIMER1) ? new_IUPAC_set(p1, p1_len) : NULL;
+  p2_iupac = (ambig_primer & PRIMER2) ? new_IUPAC_set(p2, p2_len) : NULL;
+  p1_3prime_mask = p2_3prime_mask = 0;
+  packed_primer = 0;
   global_prev = NULL;
+  id = 0;
 }
 
 STS::~STS ()
 {
   delete_String(pcr_p1);
   delete_String(pcr_p2);
+  delete [] p1_iupac;
+  delete [] p2_iupac;
 }
 
 
@@ -3,6 +3,10 @@
 
 #include "util.h"
 
+#ifndef __MWERKS__
+#include <pthread.h>
+#endif
+
 // This can be increased using S=## on the command line
 #define ePCR_MAX_STS_LINE_LENGTH_DEFAULT 1022   // So line buffer is 1024
 
@@ -72,6 +76,71 @@ take 16GB of RAM.  Hope that's not too limiting.
 #define ePCR_IUPAC_MODE_MAX 1
 
 
+// Search engines (E= on the command line)
+#define ePCR_ENGINE_HASH 0   // seed on the left primer, then look for the right one
+#define ePCR_ENGINE_JOIN 1   // seed on both primers and join them by product size
+#define ePCR_ENGINE_BATCH 2  // as hash, but verify the seeds in batches grouped by STS
+#define ePCR_ENGINE_AC 3     // find whole left primers with an Aho-Corasick automaton (N=0)
+#define ePCR_ENGINE_FM 4     // search a saved FM index of the sequence file (see fmindex.h)
+#define ePCR_ENGINE_COUNT 5
+#define ePCR_ENGINE_DEFAULT ePCR_ENGINE_HASH
+
+extern const char *ePCR_engine_names[];
+int ePCR_EngineByName (const char *name);
+
+// How the threads share out the search (D= on the command line)
+#define ePCR_SHARD_AUTO 0    // by STS's if the index is larger than the cache, else by sequence
+#define ePCR_SHARD_SEQ 1     // each task searches a stretch of sequence for all the STS's
+#define ePCR_SHARD_STS 2     // T tasks search each stretch, each for a range of hash values
+#define ePCR_SHARD_COUNT 3
+#define ePCR_SHARD_DEFAULT ePCR_SHARD_AUTO
+
+extern const char *ePCR_shard_names[];
+int ePCR_ShardByName (const char *name);
+
+// Scheduling of the search (see PCRmachine::QueueSeq).  The work of
+// searching a stretch of sequence is estimated by EstimateWork(), in
+// bases weighted by the STS's tried at each one.  A sequence of less
+// than 2*ePCR_MIN_TASK_WORK is searched as one task.  A longer one is
+// cut into tasks of about ePCR_TASK_WORK, but into no fewer than T (of
+// at least ePCR_MIN_TASK_WORK, and no shorter than the overlap between
+// tasks) so that all the threads get some of it.  Tasks are queued
+// across sequences, and no more than ePCR_TASKS_PER_THREAD*T of them
+// are searched or waiting for their hits to be written at a time.
+// With T=0, me-PCR starts no more threads than there are
+// ePCR_MIN_TASK_WORK in the sequence file.
+#ifndef ePCR_MIN_TASK_WORK
+#define ePCR_MIN_TASK_WORK 65536
+#endif
+#ifndef ePCR_TASK_WORK
+#define ePCR_TASK_WORK (1 << 18)
+#endif
+#define ePCR_TASKS_PER_THREAD 16
+
+
+// _scode value for anything but A, C, G or T
+#define AMBIG 100
+
+// Values for STS::ambig_primer
+#define PRIMER1 1
+#define PRIMER2 2
+
+
+// A primer of up to 64 unambiguous bases (A, C, G and T only), packed
+// two bits per base for verification by XOR and popcount.  Base i is
+// in bits 2i and 2i+1 of bases[i/32] (counting from the least
+// significant bit), coded as ((ascii >> 1) & 3): A=0, C=1, T=2, G=3.
+// three_prime has the low bit of a base's two bits set if the X= option
+// disallows a mismatch there.
+#define ePCR_PACKED_PRIMER_MIN 8
+#define ePCR_PACKED_PRIMER_MAX 64
+
+typedef struct {
+  unsigned long long bases[2];
+  unsigned long long three_prime[2];
+} epcr_packed_primer_t;
+
+
 class STS
 {
 	friend class PCRmachine;
@@ -86,9 +155,21 @@ public:
 	int   margin;    // Margin to use when searching (
 	unsigned short hash_offset;  // offset of the hash from the normal position
 	char  ambig_primer;  // PRIMER1, PRIMER2, PRIMER1|PRIMER2, or 0
+	unsigned long long p1_3prime_mask;  // bit i set: no mismatch allowed at p1[i] (X=)
+	unsigned long long p2_3prime_mask;  // same for p2 (first 64 bases only)
+	unsigned char *p1_iupac;  // nucleotide set of each base of p1 (see _IUPAC_bits), if ambig_primer & PRIMER1
+	unsigned char *p2_iupac;  // same for p2, if ambig_primer & PRIMER2
+	char  packed_primer; // PRIMER1 and/or PRIMER2 if p1_packed/p2_packed are valid
+	epcr_packed_primer_t p1_packed;
+	epcr_packed_primer_t p2_packed;
 	char  direct;    // 'p' for plus, 'm' for minus
 	long  m_offset;  // offset into STS primer file (beginning of line)
+	unsigned chain_rank;  // position in its m_sts_table bucket (see PCRmachine::SortHits)
+	STS  *next_right;     // next element in the right primer table (join engine)
+	STS  *next_ac;        // next STS in an automaton output or residual list (ac engine)
+	short p2_hash_offset; // offset of the hash in p2 for the join engine, or -1
 	STS *global_prev;  // allows deallocating all STS's quickly
+	unsigned long id;  // number in the order inserted (see PCRmachine::BuildReplicas)
 
 	STS (const char *p1, const char *p2, char d, int size, long offset, int p_pcr_size_margin, unsigned short p_hash_offset,char p_ambig_primer);
 	~STS ();
@@ -105,35 +186,102 @@ typedef struct {
 } epcr_hit_t;
 
 
+// Aho-Corasick automaton over the left primers (ac engine, see
+// PCRmachine::BuildAutomaton).  The transitions are complete, so it is
+// a DFA over the base codes of _scode; state 0 is the root.  A state
+// fills half a cache line, so a step of the automaton costs at most one
+// cache miss.
+typedef struct {
+  unsigned next[4];       // next state for each base
+  unsigned dict;          // nearest proper suffix state with an output, 0 = none
+  unsigned unused;
+  STS *out;               // STS's whose left primer ends in this state (linked by next_ac)
+} epcr_ac_state_t;
+
+typedef struct {
+  epcr_ac_state_t *states;
+  unsigned num_states;
+  STS **residual;         // STS's left out of the automaton, hashed as in m_sts_table (linked by next_ac)
+  unsigned long num_residual;
+} epcr_automaton_t;
+
+
+// Read-only search parameters handed to the scan kernels (see kernels.h).
+// PCRmachine fills this in before starting the search threads.
+typedef struct {
+  STS **sts_table;
+  STS **sts_table_right;   // hashed on the right primer (join engine only)
+  const unsigned long long *occupied;  // bit h set if sts_table[h] != NULL (batch engine only)
+  const epcr_automaton_t *ac;          // left primer automaton (ac engine only)
+  unsigned int wsize;
+  unsigned int mask;
+  int mmatch;
+  unsigned int three_prime_match;
+  size_t overlap;          // longest product + margin - 1 (PCRmachine::m_overlap)
+} epcr_search_t;
+
+
+// One task of the search (see PCRmachine::QueueSeq): the primers
+// whose hash word starts at data[scan_begin] to data[scan_end-1] are
+// tried.  data holds enough of the sequence either side of that range
+// for those primers and their products.  Hit positions are relative
+// to data, which is at offset in the sequence.  When the STS's are
+// sharded, only those with a hash value from shard_first to
+// shard_last are tried, and the tasks of the other shards of the same
+// stretch follow this one (see PCRmachine::QueueTask).
 typedef struct {
   int id;
   void *object_ptr;
+  const char *seq_label;
   char * data;
   size_t offset;
   size_t length;
+  size_t scan_begin;
+  size_t scan_end;
+  int last;               // last task of its sequence
+  const epcr_search_t *search;  // index to search, or NULL for PCRmachine::m_search
+  unsigned long shard_first;
+  unsigned long shard_last;
+  int num_shards;         // tasks searching this stretch
+  unsigned long group;    // task number of the first of them
+  int shards_left;        // of the first: those not finished (protected by PCRmachine::m_lock)
   epcr_hit_t *hits;
   unsigned long num_hits;
   unsigned long num_hits_allocated;
+  char *text;             // the hits formatted for output (see PCRmachine::FormatHits)
+  size_t text_len;
+  size_t text_allocated;
+  int formatted;
+  int done;               // searched (protected by PCRmachine::m_lock)
 #ifdef EPCR_STATS  
   unsigned long hash_hits;
   unsigned long comparisons;
   unsigned long string_comparisons;
+  unsigned long sts_switches;  // runs of verification moving to another STS
+  unsigned long batches;
 #endif
 } epcr_thread_args_t;
 
 
+struct epcr_fm_index;
+struct epcr_pool;
+struct epcr_numa;
+
 class PCRmachine
 {
 public:
-        static const size_t MIN_FILESIZE_FOR_THREADING = 100000;
-
 	PCRmachine();
 	virtual ~PCRmachine();
 
 	int ReadStsFile (const char *fname);
 	int ProcessSeqThread (epcr_thread_args_t *args);
 	int ProcessSeq (const char *seq_label, const char *seq_data, size_t seq_len);
-	static void *ThreadProc (void *args);
+	int QueueSeq (const char *seq_label, const char *seq_data, size_t seq_len);
+	int QueueSeqWindow (const char *seq_label, const char *seq_data, size_t seq_len, int complete);
+	int FlushSeqs (void);
+	int ProcessIndex (const struct epcr_fm_index *fm);
+	double EstimateWork (size_t seq_len);
+	static void RunTask (void *ctx, unsigned long task, int worker);
 
 	void SetWordSize (int wdsize);
 	int GetWordSize (void);
@@ -143,7 +291,15 @@ public:
 	int GetMismatch (void);
 	void SetThreePrimeMatch (unsigned bases);
 	unsigned GetThreePrimeMatch (void);
+	void SetEngine (int engine);
+	int GetEngine (void);
+	void SetShard (int shard);
+	int GetShard (void);
+	void SetNuma (int numa);
+	int GetNuma (void);
 	unsigned long SizeStsFile (const char *fname);
+	static void RecordHit (epcr_thread_args_t *a, int pos1, int pos2, const STS *sts);
+	static void SortHits (epcr_thread_args_t *a, unsigned long first);
 
 	int   max_pcr_size;
 
@@ -168,25 +324,65 @@ protected:
 	unsigned int m_asize;
 	unsigned int m_mask;
 	unsigned int m_three_prime_match;
+	int   m_engine;
+	STS **m_sts_table_right;  // built on first use by the join engine
+	unsigned long long *m_occupied;  // built on first use by the batch engine
+	epcr_automaton_t *m_ac;          // built on first use by the ac engine
+	int   m_shard;
+	int   m_num_shards;              // tasks per stretch of sequence (see StartTasks)
+	unsigned long *m_shard_bounds;   // first hash value of each, and m_asize
+	size_t m_index_bytes;            // memory of the STS's
+	int   m_numa;
+	struct epcr_numa *m_numa_nodes;  // found on first use
+	epcr_search_t *m_replicas;       // copies of the index for the NUMA nodes
+	void **m_replica_memory;         // (see BuildReplicas), each in one block
+	size_t m_replica_size;           // of this many bytes
+	int   m_num_replicas;
+	int  *m_worker_replica;          // the copy each search thread uses
+	epcr_search_t m_replicated;      // m_search when they were made
 	STS *m_last_global_sts;   // Pointer to chain of all STS's for convenient destruction
+	epcr_search_t m_search;   // Parameters for the scan kernels
+	struct epcr_pool *m_pool; // Search threads, started on first use
+	epcr_thread_args_t *m_args;  // Ring of the tasks queued (see QueueSeq),
+	int m_num_args;              // kept with their buffers for the next ones
+	unsigned long m_next_task;   // tasks queued so far
+	unsigned long m_written;     // tasks whose hits have been reported
+	pthread_mutex_t m_lock;
+	pthread_cond_t m_task_done;
+	int m_format_hits;           // the threads format the hits (ReportHit() isn't overridden)
+	char *m_fname;               // STS file, opened again by each
+	FILE **m_thread_files;       // search thread to format its hits
+	int m_num_thread_files;
+	unsigned long m_seq_hits;    // hits reported so far for the current sequence
+	size_t m_task_length;        // bases in a task of ePCR_TASK_WORK,
+	size_t m_min_task_length;    // and in the shortest one (see StartTasks)
+	const char *m_window_data;   // sequence being queued a window at a time,
+	size_t m_window_begin;       // and the first of its words not queued yet
+#ifdef EPCR_STATS
+	epcr_thread_args_t m_seq_stats;
+#endif
 
 	void InsertSTS (STS *sts, unsigned hash);
+	void SetPrimerMasks (STS *sts);
 	int HashValue (const char *primer, int primer_len, unsigned &hash);
-	inline int Match (
-			  const char *seq,
-			  size_t seq_len, 
-			  int k,
-			  const STS *sts,
-			  epcr_thread_args_t *args
-        );
-	inline int seqmcmp (const char *s1, const char *s2, int len, int strand);
-	inline int seqmcmp_ambig (const char *s1, const char *s2, int len, int strand);
-	void ReportHits (const char *seq_label, epcr_thread_args_t *a, int num_threads);
-	void RecordHit (epcr_thread_args_t *a, int pos1, int pos2, const STS *sts);
+	void BuildJoinTable (void);
+	void BuildOccupancy (void);
+	void PrepareSearch (void);
+	void BuildAutomaton (void);
+	void FreeAutomaton (void);
+	void StartTasks (void);
+	epcr_thread_args_t *AddTask (void);
+	void QueueTask (const char *seq_label, const char *seq_data, size_t seq_len,
+			size_t begin, size_t end, int last);
+	void ChooseShards (void);
+	void BuildReplicas (void);
+	void CopyIndex (int replica, int node);
+	void FreeReplicas (void);
+	void MergeShards (epcr_thread_args_t *first);
+	void WriteTasks (unsigned long until);
+	void FormatHits (epcr_thread_args_t *a, int worker);
+	void ReportHits (epcr_thread_args_t *a, int num_tasks);
 };
 
 
 #endif
-
-/* Compilers disagree where these class constants should be initialized */
-/* const size_t PCRmachine::MIN_FILESIZE_FOR_THREADING = 100000;*/
@@ -28,6 +28,11 @@
 #else
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#ifdef __linux__
+#include <sched.h>
 #endif
 
 #include "util.h"
@@ -110,21 +115,17 @@ void TimeSlice (void)
 #endif
 
 
-// Wrapper to abstract the main e-PCR output routine
-int ePCR_printf(const char *fmt, ...)
+// The output file, opened for appending (or stdout)
+static FILE *ePCR_OpenOutput (int &using_stdout)
 {
-         va_list args;
-         char buf[1000];
-        int i;
         FILE *f;
         static int virgin = 1;
         static char *open_mode = "a";
-	static int using_stdout = 0;
-
-	ePCR_hits++;
+	static int use_stdout = 0;
 
 	if (virgin && strcasecmp(ePCR_outfile, "stdout")==0)
-	  using_stdout = 1;
+	  use_stdout = 1;
+	using_stdout = use_stdout;
 
 	if (using_stdout) 
 	  f = stdout;
@@ -140,6 +141,22 @@ int ePCR_printf(const char *fmt, ...)
 	  virgin = 0;
 	  open_mode = "a";
 	}
+	return f;
+}
+
+
+// Wrapper to abstract the main e-PCR output routine
+int ePCR_printf(const char *fmt, ...)
+{
+         va_list args;
+         char buf[ePCR_OUTPUT_LINE_MAX+1];
+        int i;
+        FILE *f;
+	int using_stdout;
+
+	ePCR_hits++;
+
+	f = ePCR_OpenOutput (using_stdout);
 
          va_start(args, fmt);
          i=vsprintf(buf,fmt,args);
@@ -165,6 +182,41 @@ int ePCR_printf(const char *fmt, ...)
 }
 
 
+// Write lines of output already formatted (by the search threads),
+// as ePCR_printf() would have written them one at a time
+int ePCR_write(const char *buf, size_t len)
+{
+        FILE *f;
+	int using_stdout;
+	const char *p, *line = buf;
+
+	if (len == 0)
+	  return 0;
+
+	for (p=buf; p<buf+len; p++)
+	  if (*p == '\n') {
+	    ePCR_hits++;
+	    if (!ePCR_quiet) {
+	      fprintf (stderr, "\n\tHIT: ");
+	      fwrite (line, p+1-line, 1, stderr);
+	    }
+	    line = p+1;
+	  }
+
+	f = ePCR_OpenOutput (using_stdout);
+
+	if (fwrite (buf, len, 1, f) != 1) {
+	  fprintf (stderr, "ERROR: error writing to output file: %s\n", strerror(errno));
+	  exit(1);
+	}
+
+	if (!using_stdout)
+	  fclose (f);
+
+	return (int) len;
+}
+
+
 // Return the number of bytes in a file
 unsigned long ePCR_FileSize (const char *fname) {
 	struct stat a_stat;
@@ -179,7 +231,109 @@ unsigned long ePCR_FileSize (const char *fname) {
 }  // FileSize()
 
 
-bool __MemAlloc (void **ptr, int size)
+// The CPU bandwidth allowed by the cgroup file fname, in CPUs (rounded
+// up), or 0 if there is no limit.  Version 2 has "quota period" (or
+// "max period") in cpu.max; version 1 has the two in files of their
+// own, quota -1 for none.
+static int CgroupCPUs (const char *fname, const char *period_fname)
+{
+  FILE *f;
+  char quota[32];
+  long period = 0;
+  int n = 0;
+
+  if ((f = fopen (fname, "r")) == NULL)
+    return 0;
+  n = fscanf (f, "%31s %ld", quota, &period);
+  fclose (f);
+  if (n < 1 || !isdigit (quota[0]))
+    return 0;
+  if (period_fname) {
+    if ((f = fopen (period_fname, "r")) == NULL)
+      return 0;
+    n = fscanf (f, "%ld", &period);
+    fclose (f);
+    if (n != 1)
+      return 0;
+  } else if (n != 2)
+    return 0;
+  if (period <= 0)
+    return 0;
+  return (int) ((atol (quota) + period - 1) / period);
+}
+
+
+// Number of CPUs this process may use (for T=0): those online, or
+// those in its affinity mask, and no more than its cgroup's CPU quota
+int ePCR_NumCPUs (void)
+{
+  int cpus = 1, quota = 0;
+
+#if defined(_SC_NPROCESSORS_ONLN)
+  long online = sysconf (_SC_NPROCESSORS_ONLN);
+  if (online > 0)
+    cpus = (int) online;
+#endif
+
+#if defined(__linux__) && defined(CPU_COUNT)
+  cpu_set_t mask;
+  if (sched_getaffinity (0, sizeof(mask), &mask) == 0 && CPU_COUNT (&mask) > 0)
+    cpus = CPU_COUNT (&mask);
+
+  // cgroup v2: this process's group is the "0::/path" line of
+  // /proc/self/cgroup (the root of /sys/fs/cgroup in most containers)
+  char line[512], fname[600];
+  FILE *f = fopen ("/proc/self/cgroup", "r");
+  if (f) {
+    while (fgets (line, sizeof(line), f)) {
+      if (strncmp (line, "0::", 3) == 0) {
+	line[strcspn (line, "\r\n")] = '\0';
+	sprintf (fname, "/sys/fs/cgroup%s/cpu.max", line+3);
+	quota = CgroupCPUs (fname, NULL);
+      }
+    }
+    fclose (f);
+  }
+  if (quota == 0)
+    quota = CgroupCPUs ("/sys/fs/cgroup/cpu.max", NULL);
+  if (quota == 0)
+    quota = CgroupCPUs ("/sys/fs/cgroup/cpu/cpu.cfs_quota_us", "/sys/fs/cgroup/cpu/cpu.cfs_period_us");
+  if (quota == 0)
+    quota = CgroupCPUs ("/sys/fs/cgroup/cpu,cpuacct/cpu.cfs_quota_us", "/sys/fs/cgroup/cpu,cpuacct/cpu.cfs_period_us");
+#endif
+
+  if (quota > 0 && quota < cpus)
+    cpus = quota;
+  return cpus;
+}
+
+
+// Size in bytes of the last level cache (for D=auto)
+unsigned long ePCR_CacheSize (void)
+{
+#if defined(_SC_LEVEL3_CACHE_SIZE)
+  long size = sysconf (_SC_LEVEL3_CACHE_SIZE);
+  if (size > 0)
+    return (unsigned long) size;
+#endif
+
+#ifdef __linux__
+  FILE *f = fopen ("/sys/devices/system/cpu/cpu0/cache/index3/size", "r");
+  if (f) {
+    unsigned long n;
+    char unit = 'K';
+    int got = fscanf (f, "%lu%c", &n, &unit);
+    fclose (f);
+    if (got >= 1 && n > 0)
+      return (unit == 'M') ? n << 20 : (unit == 'K') ? n << 10 : n;
+  }
+#endif
+
+  return ePCR_CACHE_SIZE_DEFAULT;
+}
+
+
+bool __MemAlloc (void **ptr, size_t size)
 {
 	if (size > 0)
 	{
@@ -197,7 +351,7 @@ bool __MemAlloc (void **ptr, int size)
 }
 
 
-bool __MemResize (void **ptr, int new_size)
+bool __MemResize (void **ptr, size_t new_size)
 {
 	void * old_ptr = *ptr;
 
@@ -39,8 +39,9 @@
 //// Default output filename
 #define ePCR_OUTFILE_DEFAULT  "stdout"
 
-//// Default number of threads
+//// Default number of threads (0 = as many as the CPUs we may use)
 #define ePCR_THREADS_DEFAULT 1
+#define ePCR_THREADS_AUTO    0
 
 extern unsigned ePCR_quiet;
 extern unsigned ePCR_priority;
@@ -57,8 +58,8 @@ extern unsigned long ePCR_hits;  // count the number of hits
 	void TimeSlice (void);
 #endif
 
-bool __MemAlloc(void **ptr, int size);
-bool __MemResize(void **ptr, int newsize);
+bool __MemAlloc(void **ptr, size_t size);
+bool __MemResize(void **ptr, size_t newsize);
 bool __MemDealloc(void **ptr);
 
 #define MemAlloc(x,y)     __MemAlloc((void**)&(x),(y))
@@ -66,10 +67,19 @@ bool __MemDealloc(void **ptr);
 #define MemDealloc(x)     __MemDealloc((void**)&(x))
 
 unsigned long ePCR_FileSize (const char *fname);
+int ePCR_NumCPUs (void);
+unsigned long ePCR_CacheSize (void);
+
+//// Last level cache size, if the system doesn't say
+#define ePCR_CACHE_SIZE_DEFAULT (8UL << 20)
 
 void PrintError(const char *message);
 void FatalError(const char *message);
 
+// Longest line ePCR_printf() will write
+#define ePCR_OUTPUT_LINE_MAX 999
+
 int ePCR_printf(const char*fmt, ...);
+int ePCR_write(const char *buf, size_t len);
 
 #endif